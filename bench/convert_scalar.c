@@ -0,0 +1,13 @@
+/* The pixel conversion kernels with the vectorizer off, as the reference */
+#define WSEGLDRI2_CONVERT_SCALAR
+
+#include "mock.h"
+#include "convert.h"
+
+const ConvertKernel ConvertScalar[CONVERT_KERNELS] =
+{
+  WSEGLDRI2Convert565To8888,
+  WSEGLDRI2Convert4444To8888,
+  WSEGLDRI2Convert1555To8888,
+  WSEGLDRI2Convert8888To565
+};
@@ -0,0 +1,11 @@
+/* The pixel conversion kernels as the plugin builds them, vectorized */
+#include "mock.h"
+#include "convert.h"
+
+const ConvertKernel ConvertSIMD[CONVERT_KERNELS] =
+{
+  WSEGLDRI2Convert565To8888,
+  WSEGLDRI2Convert4444To8888,
+  WSEGLDRI2Convert1555To8888,
+  WSEGLDRI2Convert8888To565
+};
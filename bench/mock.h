@@ -0,0 +1,41 @@
+/*
+ * Pieces of the benchmark harness shared between the mock PVR2D, the
+ * stand-in X server and the benchmark itself.
+ */
+#ifndef _MOCK_H_
+#define _MOCK_H_
+
+#include <sys/types.h>
+
+/* Size of the screen and the framebuffer, MOCK_SCREEN_WIDTH/HEIGHT */
+unsigned long MockScreenWidth(void);
+unsigned long MockScreenHeight(void);
+
+/*
+ * Bind a free display number on the abstract X11 socket namespace. Returns
+ * the listening socket and sets display, or returns -1.
+ */
+int MockServerListen(int *display);
+
+/* Serve clients of the listening socket until killed */
+void MockServerRun(int fd);
+
+/*
+ * Fork a server off on a free display and point DISPLAY at it, which is
+ * also where the plugin connects for the default display. Returns the pid
+ * of the server, which dies with its parent, or -1.
+ */
+pid_t MockServerStart(void);
+
+/*
+ * The pixel conversion kernels of convert.h built vectorized and scalar, in
+ * the order 565, 4444 and 1555 to 8888, then 8888 to 565.
+ */
+#define CONVERT_KERNELS 4
+
+typedef void (*ConvertKernel)(char *dst, const char *src, unsigned long width);
+
+extern const ConvertKernel ConvertSIMD[CONVERT_KERNELS];
+extern const ConvertKernel ConvertScalar[CONVERT_KERNELS];
+
+#endif
@@ -0,0 +1,552 @@
+/*
+ * PVR2D and app hints on plain memory, for running the plugin on a machine
+ * without the driver. Blits are done with the CPU when they are issued and
+ * only count as complete after a configurable latency, as are wraps and
+ * framebuffer lookups:
+ *
+ *   MOCK_PVR2D_WRAP_US   time PVR2DMemWrap takes, default 0
+ *   MOCK_PVR2D_FB_US     time PVR2DGetFrameBuffer takes, default 0
+ *   MOCK_PVR2D_BLIT_US   time until a blit is complete, default 0
+ *   MOCK_PVR2D_FLIP_BUFFERS  most buffers in a flip chain, 0 for none,
+ *                        default 3
+ *   MOCK_SCREEN_WIDTH, MOCK_SCREEN_HEIGHT  framebuffer size, default 800x480
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "services.h"
+#include "pvr2d.h"
+#include "mock.h"
+
+typedef struct
+{
+  PVR2DMEMINFO meminfo;
+  /* Memory of our own, NULL for wrapped and framebuffer memory */
+  void *allocation;
+  struct timespec busy_until;
+} mock_meminfo;
+
+typedef struct
+{
+  unsigned long num_buffers;
+  mock_meminfo *buffers[3];
+  unsigned long interval;
+} mock_flip_chain;
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long next_dev_addr = 0x10000000;
+static void *framebuffer;
+static unsigned long flip_chains;
+
+static unsigned long
+MockEnv(const char *name, unsigned long def)
+{
+  const char *value = getenv(name);
+
+  return value && *value ? strtoul(value, NULL, 0) : def;
+}
+
+unsigned long
+MockScreenWidth(void)
+{
+  return MockEnv("MOCK_SCREEN_WIDTH", 800);
+}
+
+unsigned long
+MockScreenHeight(void)
+{
+  return MockEnv("MOCK_SCREEN_HEIGHT", 480);
+}
+
+static void
+MockLatency(const char *name)
+{
+  unsigned long us = MockEnv(name, 0);
+  struct timespec ts;
+
+  if (!us)
+    return;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  nanosleep(&ts, NULL);
+}
+
+static int
+MockBpp(PVR2DFORMAT format)
+{
+  return format == PVR2D_ARGB8888 ? 4 : 2;
+}
+
+static mock_meminfo *
+MockNewMemInfo(void *base, unsigned long size, void *allocation)
+{
+  mock_meminfo *mem = (mock_meminfo *)calloc(1, sizeof(*mem));
+
+  if (!mem)
+    return NULL;
+
+  pthread_mutex_lock(&mock_lock);
+  mem->meminfo.ui32DevAddr = next_dev_addr;
+  next_dev_addr += (size + 4095) & ~4095UL;
+  pthread_mutex_unlock(&mock_lock);
+
+  mem->meminfo.hPrivateData = mem;
+  mem->meminfo.ui32MemSize = size;
+  mem->meminfo.pBase = base;
+  mem->allocation = allocation;
+
+  return mem;
+}
+
+static void
+MockFreeMemInfo(mock_meminfo *mem)
+{
+  free(mem->allocation);
+  free(mem);
+}
+
+int
+PVR2DEnumerateDevices(PVR2DDEVICEINFO *pDevInfo)
+{
+  if (pDevInfo)
+  {
+    pDevInfo->ulDevID = 0;
+    strcpy(pDevInfo->szDeviceName, "mock");
+    return PVR2D_OK;
+  }
+
+  return 1;
+}
+
+PVR2DERROR
+PVR2DCreateDeviceContext(PVR2D_ULONG ulDevID, PVR2DCONTEXTHANDLE *phContext,
+                         PVR2D_ULONG ulFlags)
+{
+  unsigned long size = MockScreenWidth() * MockScreenHeight() * 4;
+
+  if (ulDevID)
+    return PVR2DERROR_DEVICE_NOT_PRESENT;
+
+  pthread_mutex_lock(&mock_lock);
+
+  if (!framebuffer)
+    framebuffer = calloc(1, size);
+
+  pthread_mutex_unlock(&mock_lock);
+
+  if (!framebuffer)
+    return PVR2DERROR_MEMORY_UNAVAILABLE;
+
+  *phContext = (PVR2DCONTEXTHANDLE)&framebuffer;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DDestroyDeviceContext(PVR2DCONTEXTHANDLE hContext)
+{
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DGetDeviceInfo(PVR2DCONTEXTHANDLE hContext,
+                   PVR2DDISPLAYINFO *pDisplayInfo)
+{
+  unsigned long flip_buffers = MockEnv("MOCK_PVR2D_FLIP_BUFFERS", 3);
+
+  memset(pDisplayInfo, 0, sizeof(*pDisplayInfo));
+  pDisplayInfo->ulMaxFlipChains = flip_buffers ? 1 : 0;
+  pDisplayInfo->ulMaxBuffersInChain = flip_buffers;
+  pDisplayInfo->eFormat = PVR2D_ARGB8888;
+  pDisplayInfo->ulWidth = MockScreenWidth();
+  pDisplayInfo->ulHeight = MockScreenHeight();
+  pDisplayInfo->lStride = pDisplayInfo->ulWidth * 4;
+  pDisplayInfo->ulMinFlipInterval = 0;
+  pDisplayInfo->ulMaxFlipInterval = 1;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DGetFrameBuffer(PVR2DCONTEXTHANDLE hContext, PVR2D_INT nHeap,
+                    PVR2DMEMINFO **ppsMemInfo)
+{
+  mock_meminfo *mem;
+
+  MockLatency("MOCK_PVR2D_FB_US");
+  mem = MockNewMemInfo(framebuffer,
+                       MockScreenWidth() * MockScreenHeight() * 4, NULL);
+
+  if (!mem)
+    return PVR2DERROR_MEMORY_UNAVAILABLE;
+
+  *ppsMemInfo = &mem->meminfo;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DMemAlloc(PVR2DCONTEXTHANDLE hContext, PVR2D_ULONG ulBytes,
+              PVR2D_ULONG ulAlign, PVR2D_ULONG ulFlags,
+              PVR2DMEMINFO **ppsMemInfo)
+{
+  mock_meminfo *mem;
+  void *allocation;
+
+  if (posix_memalign(&allocation, ulAlign < sizeof(void *) ?
+                     sizeof(void *) : ulAlign, ulBytes))
+  {
+    return PVR2DERROR_MEMORY_UNAVAILABLE;
+  }
+
+  mem = MockNewMemInfo(allocation, ulBytes, allocation);
+
+  if (!mem)
+  {
+    free(allocation);
+    return PVR2DERROR_MEMORY_UNAVAILABLE;
+  }
+
+  *ppsMemInfo = &mem->meminfo;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DMemWrap(PVR2DCONTEXTHANDLE hContext, PVR2D_VOID *pMem,
+             PVR2D_ULONG ulFlags, PVR2D_ULONG ulBytes,
+             PVR2D_ULONG alPageAddress[], PVR2DMEMINFO **ppsMemInfo)
+{
+  mock_meminfo *mem;
+
+  MockLatency("MOCK_PVR2D_WRAP_US");
+  mem = MockNewMemInfo(pMem, ulBytes, NULL);
+
+  if (!mem)
+    return PVR2DERROR_MEMORY_UNAVAILABLE;
+
+  *ppsMemInfo = &mem->meminfo;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DMemFree(PVR2DCONTEXTHANDLE hContext, PVR2DMEMINFO *psMemInfo)
+{
+  if (!psMemInfo)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  MockFreeMemInfo((mock_meminfo *)psMemInfo->hPrivateData);
+
+  return PVR2D_OK;
+}
+
+/* Where the source pixel at x, y ends up with the blit's rotation */
+static void
+MockRotate(PVR2DBLTINFO *blt, long x, long y, long *dx, long *dy)
+{
+  switch (blt->BlitFlags & (PVR2D_BLIT_ROT_90 | PVR2D_BLIT_ROT_180 |
+                            PVR2D_BLIT_ROT_270))
+  {
+    case PVR2D_BLIT_ROT_90:
+      *dx = y;
+      *dy = blt->SizeX - 1 - x;
+      break;
+    case PVR2D_BLIT_ROT_180:
+      *dx = blt->SizeX - 1 - x;
+      *dy = blt->SizeY - 1 - y;
+      break;
+    case PVR2D_BLIT_ROT_270:
+      *dx = blt->SizeY - 1 - y;
+      *dy = x;
+      break;
+    default:
+      *dx = x;
+      *dy = y;
+      break;
+  }
+}
+
+PVR2DERROR
+PVR2DBlt(PVR2DCONTEXTHANDLE hContext, PVR2DBLTINFO *pBltInfo)
+{
+  PVR2DBLTINFO *blt = pBltInfo;
+  mock_meminfo *dst_mem;
+  int cpp = MockBpp(blt->SrcFormat);
+  unsigned long us = MockEnv("MOCK_PVR2D_BLIT_US", 0);
+  char *src;
+  char *dst;
+  long x;
+  long y;
+  long dx;
+  long dy;
+
+  if (!blt->pSrcMemInfo || !blt->pDstMemInfo ||
+      blt->SrcFormat != blt->DstFormat || blt->CopyCode != PVR2DROPcopy)
+  {
+    return PVR2DERROR_INVALID_PARAMETER;
+  }
+
+  src = (char *)blt->pSrcMemInfo->pBase + blt->SrcOffset +
+        blt->SrcY * blt->SrcStride + blt->SrcX * cpp;
+  dst = (char *)blt->pDstMemInfo->pBase + blt->DstOffset +
+        blt->DstY * blt->DstStride + blt->DstX * cpp;
+
+  if (!(blt->BlitFlags & (PVR2D_BLIT_ROT_90 | PVR2D_BLIT_ROT_180 |
+                          PVR2D_BLIT_ROT_270)))
+  {
+    long width = blt->SizeX < blt->DSizeX ? blt->SizeX : blt->DSizeX;
+    long height = blt->SizeY < blt->DSizeY ? blt->SizeY : blt->DSizeY;
+
+    for (y = 0; y < height; y++)
+      memcpy(dst + y * blt->DstStride, src + y * blt->SrcStride, width * cpp);
+  }
+  else
+  {
+    for (y = 0; y < blt->SizeY; y++)
+    {
+      for (x = 0; x < blt->SizeX; x++)
+      {
+        MockRotate(blt, x, y, &dx, &dy);
+
+        if (dx < blt->DSizeX && dy < blt->DSizeY)
+        {
+          memcpy(dst + dy * blt->DstStride + dx * cpp,
+                 src + y * blt->SrcStride + x * cpp, cpp);
+        }
+      }
+    }
+  }
+
+  dst_mem = (mock_meminfo *)blt->pDstMemInfo->hPrivateData;
+  clock_gettime(CLOCK_MONOTONIC, &dst_mem->busy_until);
+  dst_mem->busy_until.tv_sec += us / 1000000;
+  dst_mem->busy_until.tv_nsec += (us % 1000000) * 1000;
+
+  if (dst_mem->busy_until.tv_nsec >= 1000000000)
+  {
+    dst_mem->busy_until.tv_sec++;
+    dst_mem->busy_until.tv_nsec -= 1000000000;
+  }
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DQueryBlitsComplete(PVR2DCONTEXTHANDLE hContext,
+                        const PVR2DMEMINFO *pMemInfo,
+                        PVR2D_UINT uiWaitForComplete)
+{
+  mock_meminfo *mem;
+  struct timespec now;
+
+  if (!pMemInfo)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  mem = (mock_meminfo *)pMemInfo->hPrivateData;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (now.tv_sec > mem->busy_until.tv_sec ||
+      (now.tv_sec == mem->busy_until.tv_sec &&
+       now.tv_nsec >= mem->busy_until.tv_nsec))
+  {
+    return PVR2D_OK;
+  }
+
+  if (!uiWaitForComplete)
+    return PVR2DERROR_BLT_NOTCOMPLETE;
+
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mem->busy_until, NULL);
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DCreateFlipChain(PVR2DCONTEXTHANDLE hContext, PVR2D_ULONG ulFlags,
+                     PVR2D_ULONG ulNumBuffers, PVR2D_ULONG ulWidth,
+                     PVR2D_ULONG ulHeight, PVR2DFORMAT eFormat,
+                     PVR2D_LONG *plStride, PVR2D_ULONG *pulFlipChainID,
+                     PVR2DFLIPCHAINHANDLE *phFlipChain)
+{
+  mock_flip_chain *chain;
+  PVR2DMEMINFO *meminfo;
+  long stride = ulWidth * MockBpp(eFormat);
+  unsigned long i;
+
+  if (ulNumBuffers < 2 ||
+      ulNumBuffers > MockEnv("MOCK_PVR2D_FLIP_BUFFERS", 3) ||
+      ulNumBuffers > 3 || ulWidth != MockScreenWidth() ||
+      ulHeight != MockScreenHeight())
+  {
+    return PVR2DERROR_INVALID_PARAMETER;
+  }
+
+  pthread_mutex_lock(&mock_lock);
+
+  if (flip_chains)
+  {
+    pthread_mutex_unlock(&mock_lock);
+    return PVR2DERROR_DEVICE_UNAVAILABLE;
+  }
+
+  flip_chains++;
+  pthread_mutex_unlock(&mock_lock);
+
+  chain = (mock_flip_chain *)calloc(1, sizeof(*chain));
+
+  if (!chain)
+    goto err;
+
+  for (i = 0; i < ulNumBuffers; i++)
+  {
+    if (PVR2DMemAlloc(hContext, stride * ulHeight, 4096, 0, &meminfo))
+      goto err;
+
+    chain->buffers[i] = (mock_meminfo *)meminfo->hPrivateData;
+    chain->num_buffers++;
+  }
+
+  *plStride = stride;
+  *pulFlipChainID = 1;
+  *phFlipChain = chain;
+
+  return PVR2D_OK;
+
+err:
+  if (chain)
+    PVR2DDestroyFlipChain(hContext, chain);
+  else
+  {
+    pthread_mutex_lock(&mock_lock);
+    flip_chains--;
+    pthread_mutex_unlock(&mock_lock);
+  }
+
+  return PVR2DERROR_MEMORY_UNAVAILABLE;
+}
+
+PVR2DERROR
+PVR2DDestroyFlipChain(PVR2DCONTEXTHANDLE hContext,
+                      PVR2DFLIPCHAINHANDLE hFlipChain)
+{
+  mock_flip_chain *chain = (mock_flip_chain *)hFlipChain;
+  unsigned long i;
+
+  if (!chain)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  for (i = 0; i < chain->num_buffers; i++)
+    MockFreeMemInfo(chain->buffers[i]);
+
+  free(chain);
+
+  pthread_mutex_lock(&mock_lock);
+  flip_chains--;
+  pthread_mutex_unlock(&mock_lock);
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DGetFlipChainBuffers(PVR2DCONTEXTHANDLE hContext,
+                         PVR2DFLIPCHAINHANDLE hFlipChain,
+                         PVR2D_ULONG *pulNumBuffers,
+                         PVR2DMEMINFO *psMemInfo[])
+{
+  mock_flip_chain *chain = (mock_flip_chain *)hFlipChain;
+  unsigned long i;
+
+  if (!chain)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  for (i = 0; i < chain->num_buffers; i++)
+    psMemInfo[i] = &chain->buffers[i]->meminfo;
+
+  *pulNumBuffers = chain->num_buffers;
+
+  return PVR2D_OK;
+}
+
+/* Only the interval, checked against what PVR2DGetDeviceInfo reports */
+PVR2DERROR
+PVR2DSetPresentFlipProperties(PVR2DCONTEXTHANDLE hContext,
+                              PVR2DFLIPCHAINHANDLE hFlipChain,
+                              PVR2D_ULONG ulPropertyMask, PVR2D_LONG lDstXPos,
+                              PVR2D_LONG lDstYPos, PVR2D_ULONG ulNumClipRects,
+                              PVR2DRECT *pClipRects,
+                              PVR2D_ULONG ulSwapInterval)
+{
+  mock_flip_chain *chain = (mock_flip_chain *)hFlipChain;
+  PVR2DDISPLAYINFO info;
+
+  if (!chain || ulPropertyMask != PVR2D_PRESENT_PROPERTY_INTERVAL)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  PVR2DGetDeviceInfo(hContext, &info);
+
+  if (ulSwapInterval < info.ulMinFlipInterval ||
+      ulSwapInterval > info.ulMaxFlipInterval)
+  {
+    return PVR2DERROR_INVALID_PARAMETER;
+  }
+
+  chain->interval = ulSwapInterval;
+
+  return PVR2D_OK;
+}
+
+PVR2DERROR
+PVR2DPresentFlip(PVR2DCONTEXTHANDLE hContext, PVR2DFLIPCHAINHANDLE hFlipChain,
+                 PVR2DMEMINFO *psMemInfo, PVR2D_LONG lRenderID)
+{
+  if (!hFlipChain || !psMemInfo)
+    return PVR2DERROR_INVALID_PARAMETER;
+
+  return PVR2D_OK;
+}
+
+IMG_VOID
+PVRSRVCreateAppHintState(IMG_MODULE_ID eModuleID, const IMG_CHAR *pszAppName,
+                         IMG_VOID **ppvState)
+{
+  *ppvState = NULL;
+}
+
+IMG_VOID
+PVRSRVFreeAppHintState(IMG_MODULE_ID eModuleID, IMG_VOID *pvHintState)
+{
+}
+
+IMG_BOOL
+PVRSRVGetAppHint(IMG_VOID *pvHintState, const IMG_CHAR *pszHintName,
+                 IMG_DATA_TYPE eDataType, const IMG_VOID *pvDefault,
+                 IMG_VOID *pvReturn)
+{
+  const char *value = getenv(pszHintName);
+
+  switch (eDataType)
+  {
+    case IMG_STRING_TYPE:
+      snprintf((char *)pvReturn, PATH_MAX, "%s",
+               value ? value : (const char *)pvDefault);
+      break;
+    case IMG_UINT_TYPE:
+    case IMG_FLAG_TYPE:
+      *(IMG_UINT32 *)pvReturn = value ? strtoul(value, NULL, 0) :
+                                        *(const IMG_UINT32 *)pvDefault;
+      break;
+    case IMG_INT_TYPE:
+      *(IMG_INT32 *)pvReturn = value ? strtol(value, NULL, 0) :
+                                       *(const IMG_INT32 *)pvDefault;
+      break;
+    default:
+      return 0;
+  }
+
+  return value != NULL;
+}
@@ -0,0 +1,1342 @@
+/*
+ * A stand-in X server with just enough of the core protocol, MIT-SHM, XFIXES
+ * and DRI2 for the plugin and the benchmark to run on any Linux box. Only
+ * clients of the same byte order are served, over an abstract Unix socket.
+ *
+ * DRI2 buffers are SysV shm segments named by their id, removed as soon as
+ * they are created so nothing outlives the server. Swaps complete at once:
+ *
+ *   MOCK_DRI2_MINOR      DRI2 minor version offered, default 4
+ *   MOCK_DRI2_SWAP       "exchange" (default) swaps the back and front
+ *                        buffers and invalidates them, "copy" copies
+ *   MOCK_DRI2_FLIP       when set, a window covering the whole screen gets
+ *                        the framebuffer (name -1) as its back buffer
+ *   MOCK_DRI2_NO_FORMAT  when set, GetBuffersWithFormat ignores the format
+ *                        and hands out buffers of the drawable's depth
+ *   MOCK_NO_SHM          when set, MIT-SHM is not offered
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/prctl.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/X.h>
+#include <X11/Xproto.h>
+#include <X11/extensions/dri2proto.h>
+#include <X11/extensions/dri2tokens.h>
+#include <X11/extensions/shmproto.h>
+#include <X11/extensions/xfixesproto.h>
+
+#include "mock.h"
+
+/* Xlib.h would clash with the protocol headers */
+typedef int Bool;
+#define True 1
+#define False 0
+
+#define MAX_CLIENTS 16
+#define ROOT_WINDOW 0x100
+#define DEFAULT_COLORMAP 0x101
+#define VISUAL_24 0x21
+#define VISUAL_16 0x22
+#define VISUAL_32 0x23
+#define RID_MASK 0x1FFFFF
+
+#define DRI2_OPCODE 128
+#define XFIXES_OPCODE 129
+#define SHM_OPCODE 130
+#define DRI2_EVENT 64
+#define XFIXES_EVENT 66
+#define SHM_EVENT 68
+#define XFIXES_ERROR 128
+#define SHM_ERROR 129
+
+typedef struct
+{
+  int shmid;
+  char *addr;
+  unsigned int pitch;
+  unsigned int cpp;
+} mock_buffer;
+
+typedef struct _mock_client mock_client;
+
+typedef struct _mock_drawable mock_drawable;
+struct _mock_drawable
+{
+  mock_drawable *next;
+  CARD32 id;
+  Bool is_window;
+  unsigned int width;
+  unsigned int height;
+  unsigned int depth;
+  /* DRI2 front and back, a pixmap's front is its contents */
+  mock_buffer buffers[2];
+  mock_client *dri2_client;
+  CARD64 msc;
+  CARD64 sbc;
+};
+
+typedef struct _mock_segment mock_segment;
+struct _mock_segment
+{
+  mock_segment *next;
+  mock_client *client;
+  CARD32 shmseg;
+  char *addr;
+};
+
+struct _mock_client
+{
+  int fd;
+  Bool set_up;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_size;
+  unsigned int sequence;
+  CARD32 rid_base;
+};
+
+static mock_client clients[MAX_CLIENTS];
+static mock_drawable *drawables;
+static mock_segment *segments;
+static int dri2_minor;
+static Bool swap_exchange;
+static Bool swap_flip;
+static Bool ignore_format;
+static Bool no_shm;
+
+static void
+MockWrite(mock_client *client, const void *data, size_t len)
+{
+  const char *p = (const char *)data;
+  ssize_t n;
+
+  while (len && client->fd >= 0)
+  {
+    n = write(client->fd, p, len);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+    {
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+
+    p += n;
+    len -= n;
+  }
+}
+
+/* A 32 byte reply followed by extra_len bytes, padded to 4 */
+static void
+MockReply(mock_client *client, void *reply, const void *extra,
+          size_t extra_len)
+{
+  xGenericReply *generic = (xGenericReply *)reply;
+  static const char pad[3];
+
+  generic->type = X_Reply;
+  generic->sequenceNumber = client->sequence;
+  generic->length = (extra_len + 3) / 4;
+  MockWrite(client, reply, sz_xGenericReply);
+
+  if (extra_len)
+  {
+    MockWrite(client, extra, extra_len);
+    MockWrite(client, pad, (4 - extra_len % 4) % 4);
+  }
+}
+
+static void
+MockError(mock_client *client, int code, CARD32 resource, int major,
+          int minor)
+{
+  xError error;
+
+  memset(&error, 0, sizeof(error));
+  error.type = X_Error;
+  error.errorCode = code;
+  error.sequenceNumber = client->sequence;
+  error.resourceID = resource;
+  error.majorCode = major;
+  error.minorCode = minor;
+  MockWrite(client, &error, sizeof(error));
+}
+
+static void
+MockEvent(mock_client *client, void *event)
+{
+  ((xGenericReply *)event)->sequenceNumber = client->sequence;
+  MockWrite(client, event, 32);
+}
+
+static CARD64
+MockUst(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (CARD64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static mock_drawable *
+MockFindDrawable(CARD32 id)
+{
+  mock_drawable *drawable;
+
+  for (drawable = drawables; drawable; drawable = drawable->next)
+  {
+    if (drawable->id == id)
+      return drawable;
+  }
+
+  return NULL;
+}
+
+static mock_segment *
+MockFindSegment(mock_client *client, CARD32 shmseg)
+{
+  mock_segment *segment;
+
+  for (segment = segments; segment; segment = segment->next)
+  {
+    if (segment->client == client && segment->shmseg == shmseg)
+      return segment;
+  }
+
+  return NULL;
+}
+
+static void
+MockFreeBuffer(mock_buffer *buffer)
+{
+  if (buffer->addr)
+    shmdt(buffer->addr);
+
+  memset(buffer, 0, sizeof(*buffer));
+}
+
+static Bool
+MockAllocBuffer(mock_buffer *buffer, unsigned int width, unsigned int height,
+                unsigned int cpp)
+{
+  buffer->pitch = (width * cpp + 63) & ~63u;
+  buffer->cpp = cpp;
+  buffer->shmid = shmget(IPC_PRIVATE, buffer->pitch * height,
+                         IPC_CREAT | 0600);
+
+  if (buffer->shmid == -1)
+    return False;
+
+  buffer->addr = shmat(buffer->shmid, NULL, 0);
+  shmctl(buffer->shmid, IPC_RMID, NULL);
+
+  if (buffer->addr == (void *)-1)
+  {
+    buffer->addr = NULL;
+    return False;
+  }
+
+  return True;
+}
+
+static void
+MockFreeDrawable(mock_drawable *drawable)
+{
+  mock_drawable **link;
+
+  for (link = &drawables; *link; link = &(*link)->next)
+  {
+    if (*link == drawable)
+    {
+      *link = drawable->next;
+      break;
+    }
+  }
+
+  MockFreeBuffer(&drawable->buffers[0]);
+  MockFreeBuffer(&drawable->buffers[1]);
+  free(drawable);
+}
+
+static mock_drawable *
+MockNewDrawable(CARD32 id, Bool is_window, unsigned int width,
+                unsigned int height, unsigned int depth)
+{
+  mock_drawable *drawable = (mock_drawable *)calloc(1, sizeof(*drawable));
+
+  if (!drawable)
+    return NULL;
+
+  drawable->id = id;
+  drawable->is_window = is_window;
+  drawable->width = width;
+  drawable->height = height;
+  drawable->depth = depth;
+  drawable->next = drawables;
+  drawables = drawable;
+
+  /* The contents of a pixmap, what puts and copies write into */
+  if (!is_window &&
+      !MockAllocBuffer(&drawable->buffers[0], width, height,
+                       depth == 16 ? 2 : 4))
+  {
+    MockFreeDrawable(drawable);
+    return NULL;
+  }
+
+  return drawable;
+}
+
+static void
+MockInvalidate(mock_drawable *drawable)
+{
+  xDRI2InvalidateBuffers event;
+
+  if (!drawable->dri2_client || drawable->dri2_client->fd < 0)
+    return;
+
+  memset(&event, 0, sizeof(event));
+  event.type = DRI2_EVENT + DRI2_InvalidateBuffers;
+  event.drawable = drawable->id;
+  MockEvent(drawable->dri2_client, &event);
+}
+
+/* Copy rows into a drawable's contents, clipped to it */
+static void
+MockPut(mock_drawable *drawable, const char *src, unsigned int src_pitch,
+        int dst_x, int dst_y, unsigned int width, unsigned int height)
+{
+  mock_buffer *dst = &drawable->buffers[0];
+  unsigned int y;
+
+  if (!dst->addr || dst_x < 0 || dst_y < 0 || dst_x >= drawable->width ||
+      dst_y >= drawable->height)
+  {
+    return;
+  }
+
+  if (width > drawable->width - dst_x)
+    width = drawable->width - dst_x;
+
+  if (height > drawable->height - dst_y)
+    height = drawable->height - dst_y;
+
+  for (y = 0; y < height; y++)
+  {
+    memcpy(dst->addr + (dst_y + y) * dst->pitch + dst_x * dst->cpp,
+           src + y * src_pitch, width * dst->cpp);
+  }
+}
+
+/* ZPixmap reads of what was put into a pixmap, for checking the copies */
+static void
+MockGetImage(mock_client *client, const xGetImageReq *req)
+{
+  mock_drawable *drawable = MockFindDrawable(req->drawable);
+  mock_buffer *src;
+  xGetImageReply reply;
+  unsigned int pitch;
+  unsigned int y;
+  char *data;
+
+  if (!drawable || drawable->is_window || !drawable->buffers[0].addr ||
+      req->format != ZPixmap || req->x < 0 || req->y < 0 ||
+      req->x + req->width > drawable->width ||
+      req->y + req->height > drawable->height)
+  {
+    MockError(client, BadMatch, req->drawable, req->reqType, 0);
+    return;
+  }
+
+  src = &drawable->buffers[0];
+  pitch = (req->width * src->cpp + 3) & ~3u;
+  data = calloc(req->height, pitch);
+
+  if (!data)
+  {
+    MockError(client, BadAlloc, req->drawable, req->reqType, 0);
+    return;
+  }
+
+  for (y = 0; y < req->height; y++)
+  {
+    memcpy(data + y * pitch,
+           src->addr + (req->y + y) * src->pitch + req->x * src->cpp,
+           req->width * src->cpp);
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.depth = drawable->depth;
+  reply.visual = None;
+  MockReply(client, &reply, data, req->height * pitch);
+  free(data);
+}
+
+static void
+MockSetup(mock_client *client)
+{
+  xConnClientPrefix *prefix = (xConnClientPrefix *)client->in;
+  static const char vendor[] = "wsegl-bench";
+  unsigned char setup[512];
+  xConnSetupPrefix *setup_prefix = (xConnSetupPrefix *)setup;
+  xConnSetup *info = (xConnSetup *)(setup_prefix + 1);
+  xPixmapFormat *formats;
+  xWindowRoot *root;
+  xDepth *depth;
+  xVisualType *visual;
+  size_t len;
+  static const struct
+  {
+    int depth;
+    VisualID id;
+    CARD32 red, green, blue;
+  } visuals[] =
+  {
+    { 24, VISUAL_24, 0xFF0000, 0xFF00, 0xFF },
+    { 16, VISUAL_16, 0xF800, 0x7E0, 0x1F },
+    { 32, VISUAL_32, 0xFF0000, 0xFF00, 0xFF }
+  };
+  static const int pixmap_formats[][2] = { {1, 1}, {16, 16}, {24, 32},
+                                           {32, 32} };
+  int i;
+
+  len = sz_xConnClientPrefix + ((prefix->nbytesAuthProto + 3) & ~3) +
+        ((prefix->nbytesAuthString + 3) & ~3);
+
+  if (client->in_len < len)
+    return;
+
+  memset(setup, 0, sizeof(setup));
+  info->release = 1;
+  info->ridBase = client->rid_base;
+  info->ridMask = RID_MASK;
+  info->nbytesVendor = sizeof(vendor) - 1;
+  info->maxRequestSize = 0xFFFF;
+  info->numRoots = 1;
+  info->numFormats = 4;
+  info->imageByteOrder = LSBFirst;
+  info->bitmapBitOrder = LSBFirst;
+  info->bitmapScanlineUnit = 32;
+  info->bitmapScanlinePad = 32;
+  info->minKeyCode = 8;
+  info->maxKeyCode = 255;
+  memcpy(info + 1, vendor, sizeof(vendor) - 1);
+
+  formats = (xPixmapFormat *)((char *)(info + 1) +
+                              ((sizeof(vendor) - 1 + 3) & ~3));
+
+  for (i = 0; i < 4; i++)
+  {
+    formats[i].depth = pixmap_formats[i][0];
+    formats[i].bitsPerPixel = pixmap_formats[i][1];
+    formats[i].scanLinePad = 32;
+  }
+
+  root = (xWindowRoot *)(formats + 4);
+  root->windowId = ROOT_WINDOW;
+  root->defaultColormap = DEFAULT_COLORMAP;
+  root->whitePixel = 0xFFFFFF;
+  root->pixWidth = MockScreenWidth();
+  root->pixHeight = MockScreenHeight();
+  root->mmWidth = root->pixWidth * 254 / 960;
+  root->mmHeight = root->pixHeight * 254 / 960;
+  root->minInstalledMaps = 1;
+  root->maxInstalledMaps = 1;
+  root->rootVisualID = VISUAL_24;
+  root->rootDepth = 24;
+  root->nDepths = 3;
+
+  depth = (xDepth *)(root + 1);
+
+  for (i = 0; i < 3; i++)
+  {
+    depth->depth = visuals[i].depth;
+    depth->nVisuals = 1;
+    visual = (xVisualType *)(depth + 1);
+    visual->visualID = visuals[i].id;
+    visual->class = TrueColor;
+    visual->bitsPerRGB = visuals[i].depth == 16 ? 6 : 8;
+    visual->colormapEntries = visuals[i].depth == 16 ? 64 : 256;
+    visual->redMask = visuals[i].red;
+    visual->greenMask = visuals[i].green;
+    visual->blueMask = visuals[i].blue;
+    depth = (xDepth *)(visual + 1);
+  }
+
+  setup_prefix->success = 1;
+  setup_prefix->majorVersion = X_PROTOCOL;
+  setup_prefix->minorVersion = X_PROTOCOL_REVISION;
+  setup_prefix->length = ((unsigned char *)depth - (unsigned char *)info) / 4;
+
+  MockWrite(client, setup, (unsigned char *)depth - setup);
+
+  client->set_up = True;
+  memmove(client->in, client->in + len, client->in_len - len);
+  client->in_len -= len;
+}
+
+static void
+MockQueryExtension(mock_client *client, const xQueryExtensionReq *req)
+{
+  xQueryExtensionReply reply;
+  const char *name = (const char *)(req + 1);
+
+  memset(&reply, 0, sizeof(reply));
+
+  if (req->nbytes == strlen(DRI2_NAME) && !memcmp(name, DRI2_NAME,
+                                                  req->nbytes))
+  {
+    reply.present = True;
+    reply.major_opcode = DRI2_OPCODE;
+    reply.first_event = DRI2_EVENT;
+  }
+  else if (req->nbytes == strlen(XFIXES_NAME) &&
+           !memcmp(name, XFIXES_NAME, req->nbytes))
+  {
+    reply.present = True;
+    reply.major_opcode = XFIXES_OPCODE;
+    reply.first_event = XFIXES_EVENT;
+    reply.first_error = XFIXES_ERROR;
+  }
+  else if (req->nbytes == 7 && !memcmp(name, "MIT-SHM", 7) && !no_shm)
+  {
+    reply.present = True;
+    reply.major_opcode = SHM_OPCODE;
+    reply.first_event = SHM_EVENT;
+    reply.first_error = SHM_ERROR;
+  }
+
+  MockReply(client, &reply, NULL, 0);
+}
+
+static void
+MockConfigureWindow(mock_client *client, const xConfigureWindowReq *req)
+{
+  mock_drawable *drawable = MockFindDrawable(req->window);
+  const CARD32 *values = (const CARD32 *)(req + 1);
+  unsigned int width;
+  unsigned int height;
+  int bit;
+
+  if (!drawable || !drawable->is_window)
+  {
+    MockError(client, BadWindow, req->window, X_ConfigureWindow, 0);
+    return;
+  }
+
+  width = drawable->width;
+  height = drawable->height;
+
+  for (bit = 0; bit < 7; bit++)
+  {
+    if (!(req->mask & (1 << bit)))
+      continue;
+
+    if (bit == 2)
+      width = *values;
+    else if (bit == 3)
+      height = *values;
+
+    values++;
+  }
+
+  if (width == drawable->width && height == drawable->height)
+    return;
+
+  /* The old buffers are gone, the client hears about it as with a swap */
+  drawable->width = width;
+  drawable->height = height;
+  MockFreeBuffer(&drawable->buffers[0]);
+  MockFreeBuffer(&drawable->buffers[1]);
+  MockInvalidate(drawable);
+}
+
+static void
+MockCore(mock_client *client, const xReq *req)
+{
+  mock_drawable *drawable;
+
+  switch (req->reqType)
+  {
+    case X_CreateWindow:
+    {
+      const xCreateWindowReq *create = (const xCreateWindowReq *)req;
+
+      MockNewDrawable(create->wid, True, create->width, create->height,
+                      create->depth ? create->depth : 24);
+      break;
+    }
+    case X_DestroyWindow:
+    case X_FreePixmap:
+      drawable = MockFindDrawable(((const xResourceReq *)req)->id);
+
+      if (drawable)
+        MockFreeDrawable(drawable);
+
+      break;
+    case X_ConfigureWindow:
+      MockConfigureWindow(client, (const xConfigureWindowReq *)req);
+      break;
+    case X_GetGeometry:
+    {
+      xGetGeometryReply reply;
+
+      drawable = MockFindDrawable(((const xResourceReq *)req)->id);
+
+      if (!drawable)
+      {
+        MockError(client, BadDrawable, ((const xResourceReq *)req)->id,
+                  req->reqType, 0);
+        break;
+      }
+
+      memset(&reply, 0, sizeof(reply));
+      reply.depth = drawable->depth;
+      reply.root = ROOT_WINDOW;
+      reply.width = drawable->width;
+      reply.height = drawable->height;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_InternAtom:
+    {
+      xInternAtomReply reply;
+      static CARD32 next_atom = 100;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.atom = next_atom++;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_GetProperty:
+    {
+      xGetPropertyReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_GetInputFocus:
+    {
+      xGetInputFocusReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.focus = None;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_CreatePixmap:
+    {
+      const xCreatePixmapReq *create = (const xCreatePixmapReq *)req;
+
+      if (!MockNewDrawable(create->pid, False, create->width, create->height,
+                           create->depth))
+      {
+        MockError(client, BadAlloc, create->pid, req->reqType, 0);
+      }
+
+      break;
+    }
+    case X_PutImage:
+    {
+      const xPutImageReq *put = (const xPutImageReq *)req;
+
+      drawable = MockFindDrawable(put->drawable);
+
+      if (drawable && put->format == ZPixmap)
+      {
+        unsigned int cpp = put->depth == 16 ? 2 : 4;
+
+        MockPut(drawable, (const char *)(put + 1),
+                (put->width * cpp + 3) & ~3u, put->dstX, put->dstY,
+                put->width, put->height);
+      }
+
+      break;
+    }
+    case X_GetImage:
+      MockGetImage(client, (const xGetImageReq *)req);
+      break;
+    case X_QueryExtension:
+      MockQueryExtension(client, (const xQueryExtensionReq *)req);
+      break;
+    case X_ListExtensions:
+    {
+      xListExtensionsReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_MapWindow:
+    case X_UnmapWindow:
+    case X_ChangeWindowAttributes:
+    case X_CreateGC:
+    case X_ChangeGC:
+    case X_FreeGC:
+    case X_NoOperation:
+      break;
+    default:
+      fprintf(stderr, "mock server: unhandled request %d\n", req->reqType);
+      MockError(client, BadRequest, 0, req->reqType, 0);
+      break;
+  }
+}
+
+static void
+MockGetBuffers(mock_client *client, const xDRI2GetBuffersReq *req,
+               Bool with_format)
+{
+  mock_drawable *drawable = MockFindDrawable(req->drawable);
+  const CARD32 *attachments = (const CARD32 *)(req + 1);
+  xDRI2GetBuffersReply reply;
+  xDRI2Buffer out[2];
+  unsigned int i;
+
+  if (!drawable || !drawable->dri2_client || req->count > 2)
+  {
+    MockError(client, BadDrawable, req->drawable, DRI2_OPCODE,
+              req->dri2ReqType);
+    return;
+  }
+
+  memset(out, 0, sizeof(out));
+
+  for (i = 0; i < req->count; i++)
+  {
+    CARD32 attachment = attachments[with_format ? 2 * i : i];
+    CARD32 format = with_format ? attachments[2 * i + 1] : 0;
+    unsigned int cpp = format && !ignore_format ? format / 8 :
+                       drawable->depth == 16 ? 2 : 4;
+    int index = attachment == DRI2BufferBackLeft ? 1 : 0;
+    mock_buffer *buffer = &drawable->buffers[index];
+
+    out[i].attachment = attachment;
+
+    if (swap_flip && index == 1 && drawable->is_window &&
+        drawable->width == MockScreenWidth() &&
+        drawable->height == MockScreenHeight())
+    {
+      out[i].name = (CARD32)-1;
+      out[i].pitch = MockScreenWidth() * 4;
+      out[i].cpp = 4;
+      continue;
+    }
+
+    if (buffer->addr && buffer->cpp != cpp && (drawable->is_window ||
+                                               index))
+    {
+      MockFreeBuffer(buffer);
+    }
+
+    if (!buffer->addr &&
+        !MockAllocBuffer(buffer, drawable->width, drawable->height, cpp))
+    {
+      MockError(client, BadAlloc, req->drawable, DRI2_OPCODE,
+                req->dri2ReqType);
+      return;
+    }
+
+    out[i].name = buffer->shmid;
+    out[i].pitch = buffer->pitch;
+    out[i].cpp = buffer->cpp;
+  }
+
+  memset(&reply, 0, sizeof(reply));
+  reply.width = drawable->width;
+  reply.height = drawable->height;
+  reply.count = req->count;
+  MockReply(client, &reply, out, req->count * sizeof(out[0]));
+}
+
+/* Blit the back buffer to the front, the fake front of a window included */
+static void
+MockCopyBack(mock_drawable *drawable)
+{
+  mock_buffer *front = &drawable->buffers[0];
+  mock_buffer *back = &drawable->buffers[1];
+  unsigned int y;
+
+  if (!front->addr || !back->addr || front->cpp != back->cpp)
+    return;
+
+  for (y = 0; y < drawable->height; y++)
+  {
+    memcpy(front->addr + y * front->pitch, back->addr + y * back->pitch,
+           drawable->width * front->cpp);
+  }
+}
+
+static void
+MockMSCReply(mock_client *client, mock_drawable *drawable)
+{
+  xDRI2MSCReply reply;
+  CARD64 ust = MockUst();
+
+  memset(&reply, 0, sizeof(reply));
+  reply.ust_hi = ust >> 32;
+  reply.ust_lo = ust & 0xFFFFFFFF;
+  reply.msc_hi = drawable->msc >> 32;
+  reply.msc_lo = drawable->msc & 0xFFFFFFFF;
+  reply.sbc_hi = drawable->sbc >> 32;
+  reply.sbc_lo = drawable->sbc & 0xFFFFFFFF;
+  MockReply(client, &reply, NULL, 0);
+}
+
+static void
+MockSwapBuffers(mock_client *client, mock_drawable *drawable)
+{
+  xDRI2SwapBuffersReply reply;
+  xDRI2BufferSwapComplete2 event;
+  CARD64 ust = MockUst();
+  mock_buffer tmp;
+
+  drawable->msc++;
+  drawable->sbc++;
+
+  /* Events caused by the swap go out before its reply, as with Xorg */
+  if (swap_exchange && drawable->is_window && drawable->buffers[0].addr &&
+      drawable->buffers[1].addr)
+  {
+    tmp = drawable->buffers[0];
+    drawable->buffers[0] = drawable->buffers[1];
+    drawable->buffers[1] = tmp;
+    MockInvalidate(drawable);
+  }
+  else
+    MockCopyBack(drawable);
+
+  memset(&reply, 0, sizeof(reply));
+  reply.swap_hi = drawable->msc >> 32;
+  reply.swap_lo = drawable->msc & 0xFFFFFFFF;
+  MockReply(client, &reply, NULL, 0);
+
+  memset(&event, 0, sizeof(event));
+  event.type = DRI2_EVENT + DRI2_BufferSwapComplete;
+  event.event_type = swap_exchange ? DRI2_EXCHANGE_COMPLETE :
+                                     DRI2_BLIT_COMPLETE;
+  event.drawable = drawable->id;
+  event.ust_hi = ust >> 32;
+  event.ust_lo = ust & 0xFFFFFFFF;
+  event.msc_hi = drawable->msc >> 32;
+  event.msc_lo = drawable->msc & 0xFFFFFFFF;
+  event.sbc = drawable->sbc;
+  MockEvent(client, &event);
+}
+
+static void
+MockDRI2(mock_client *client, const xReq *req)
+{
+  const xDRI2GetMSCReq *drawable_req = (const xDRI2GetMSCReq *)req;
+  mock_drawable *drawable = NULL;
+
+  if (req->data != X_DRI2QueryVersion && req->data != X_DRI2Connect &&
+      req->data != X_DRI2Authenticate)
+  {
+    drawable = MockFindDrawable(drawable_req->drawable);
+
+    if (!drawable)
+    {
+      MockError(client, BadDrawable, drawable_req->drawable, DRI2_OPCODE,
+                req->data);
+      return;
+    }
+  }
+
+  switch (req->data)
+  {
+    case X_DRI2QueryVersion:
+    {
+      const xDRI2QueryVersionReq *query = (const xDRI2QueryVersionReq *)req;
+      xDRI2QueryVersionReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.majorVersion = DRI2_MAJOR;
+      reply.minorVersion = query->minorVersion < dri2_minor ?
+                           query->minorVersion : dri2_minor;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_DRI2Connect:
+    {
+      static const char names[] = "pvr\0\0\0\0\0/dev/dri/card0";
+      xDRI2ConnectReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.driverNameLength = 3;
+      reply.deviceNameLength = 14;
+      MockReply(client, &reply, names, sizeof(names) - 1);
+      break;
+    }
+    case X_DRI2Authenticate:
+    {
+      xDRI2AuthenticateReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.authenticated = 1;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_DRI2CreateDrawable:
+      drawable->dri2_client = client;
+      break;
+    case X_DRI2DestroyDrawable:
+      drawable->dri2_client = NULL;
+
+      if (drawable->is_window)
+        MockFreeBuffer(&drawable->buffers[0]);
+
+      MockFreeBuffer(&drawable->buffers[1]);
+      break;
+    case X_DRI2GetBuffers:
+    case X_DRI2GetBuffersWithFormat:
+      MockGetBuffers(client, (const xDRI2GetBuffersReq *)req,
+                     req->data == X_DRI2GetBuffersWithFormat);
+      break;
+    case X_DRI2CopyRegion:
+    {
+      xDRI2CopyRegionReply reply;
+
+      MockCopyBack(drawable);
+      memset(&reply, 0, sizeof(reply));
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_DRI2SwapBuffers:
+      MockSwapBuffers(client, drawable);
+      break;
+    case X_DRI2GetMSC:
+    case X_DRI2WaitMSC:
+    case X_DRI2WaitSBC:
+      /* Every swap has completed by now */
+      MockMSCReply(client, drawable);
+      break;
+    case X_DRI2SwapInterval:
+      break;
+    default:
+      MockError(client, BadRequest, 0, DRI2_OPCODE, req->data);
+      break;
+  }
+}
+
+static void
+MockXFixes(mock_client *client, const xReq *req)
+{
+  switch (req->data)
+  {
+    case X_XFixesQueryVersion:
+    {
+      xXFixesQueryVersionReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.majorVersion = 5;
+      reply.minorVersion = 0;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_XFixesCreateRegion:
+    case X_XFixesDestroyRegion:
+      /* Copies and swaps always cover the whole drawable */
+      break;
+    default:
+      MockError(client, BadRequest, 0, XFIXES_OPCODE, req->data);
+      break;
+  }
+}
+
+static void
+MockShm(mock_client *client, const xReq *req)
+{
+  mock_segment *segment;
+
+  switch (req->data)
+  {
+    case X_ShmQueryVersion:
+    {
+      xShmQueryVersionReply reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.majorVersion = 1;
+      reply.minorVersion = 1;
+      reply.uid = getuid();
+      reply.gid = getgid();
+      reply.pixmapFormat = ZPixmap;
+      MockReply(client, &reply, NULL, 0);
+      break;
+    }
+    case X_ShmAttach:
+    {
+      const xShmAttachReq *attach = (const xShmAttachReq *)req;
+
+      segment = (mock_segment *)calloc(1, sizeof(*segment));
+
+      if (segment)
+      {
+        segment->addr = shmat(attach->shmid, NULL, SHM_RDONLY);
+
+        if (segment->addr == (void *)-1)
+        {
+          free(segment);
+          segment = NULL;
+        }
+      }
+
+      if (!segment)
+      {
+        MockError(client, BadAccess, attach->shmseg, SHM_OPCODE, req->data);
+        break;
+      }
+
+      segment->client = client;
+      segment->shmseg = attach->shmseg;
+      segment->next = segments;
+      segments = segment;
+      break;
+    }
+    case X_ShmDetach:
+    {
+      mock_segment **link;
+
+      for (link = &segments; *link; link = &(*link)->next)
+      {
+        segment = *link;
+
+        if (segment->client == client &&
+            segment->shmseg == ((const xShmDetachReq *)req)->shmseg)
+        {
+          *link = segment->next;
+          shmdt(segment->addr);
+          free(segment);
+          break;
+        }
+      }
+
+      break;
+    }
+    case X_ShmPutImage:
+    {
+      const xShmPutImageReq *put = (const xShmPutImageReq *)req;
+      unsigned int cpp = put->depth == 16 ? 2 : 4;
+      unsigned int pitch = (put->totalWidth * cpp + 3) & ~3u;
+      mock_drawable *drawable = MockFindDrawable(put->drawable);
+
+      segment = MockFindSegment(client, put->shmseg);
+
+      if (!segment)
+      {
+        MockError(client, SHM_ERROR, put->shmseg, SHM_OPCODE, req->data);
+        break;
+      }
+
+      if (drawable)
+      {
+        MockPut(drawable, segment->addr + put->offset + put->srcY * pitch +
+                put->srcX * cpp, pitch, put->dstX, put->dstY, put->srcWidth,
+                put->srcHeight);
+      }
+
+      if (put->sendEvent)
+      {
+        xShmCompletionEvent event;
+
+        memset(&event, 0, sizeof(event));
+        event.type = SHM_EVENT;
+        event.drawable = put->drawable;
+        event.minorEvent = X_ShmPutImage;
+        event.majorEvent = SHM_OPCODE;
+        event.shmseg = put->shmseg;
+        event.offset = put->offset;
+        MockEvent(client, &event);
+      }
+
+      break;
+    }
+    default:
+      MockError(client, BadRequest, 0, SHM_OPCODE, req->data);
+      break;
+  }
+}
+
+/* Run every complete request in the input buffer */
+static void
+MockProcess(mock_client *client)
+{
+  size_t len;
+  xReq *req;
+
+  if (!client->set_up)
+  {
+    if (client->in_len < sz_xConnClientPrefix)
+      return;
+
+    MockSetup(client);
+
+    if (!client->set_up)
+      return;
+  }
+
+  while (client->fd >= 0 && client->in_len >= sz_xReq)
+  {
+    req = (xReq *)client->in;
+    len = req->length * 4;
+
+    /* No BIG-REQUESTS, a zero length can't be told apart from garbage */
+    if (!len)
+    {
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+
+    if (client->in_len < len)
+      return;
+
+    client->sequence++;
+
+    if (req->reqType == DRI2_OPCODE)
+      MockDRI2(client, req);
+    else if (req->reqType == XFIXES_OPCODE)
+      MockXFixes(client, req);
+    else if (req->reqType == SHM_OPCODE)
+      MockShm(client, req);
+    else
+      MockCore(client, req);
+
+    memmove(client->in, client->in + len, client->in_len - len);
+    client->in_len -= len;
+  }
+}
+
+/* Drop everything a client left behind once it has gone */
+static void
+MockDisconnect(mock_client *client)
+{
+  mock_drawable *drawable;
+  mock_drawable *next;
+  mock_segment **link;
+  mock_segment *segment;
+
+  for (drawable = drawables; drawable; drawable = next)
+  {
+    next = drawable->next;
+
+    if ((drawable->id & ~RID_MASK) == client->rid_base)
+      MockFreeDrawable(drawable);
+    else if (drawable->dri2_client == client)
+      drawable->dri2_client = NULL;
+  }
+
+  for (link = &segments; *link;)
+  {
+    segment = *link;
+
+    if (segment->client == client)
+    {
+      *link = segment->next;
+      shmdt(segment->addr);
+      free(segment);
+    }
+    else
+      link = &segment->next;
+  }
+
+  if (client->fd >= 0)
+    close(client->fd);
+
+  free(client->in);
+  memset(client, 0, sizeof(*client));
+  client->fd = -1;
+}
+
+int
+MockServerListen(int *display)
+{
+  struct sockaddr_un addr;
+  socklen_t len;
+  int fd;
+  int i;
+
+  for (i = 64; i < 1024; i++)
+  {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+      return -1;
+
+    /* Abstract, so there is no socket file to clean up */
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                   "/tmp/.X11-unix/X%d", i);
+    len += offsetof(struct sockaddr_un, sun_path) + 1;
+
+    if (!bind(fd, (struct sockaddr *)&addr, len) && !listen(fd, 4))
+    {
+      *display = i;
+      return fd;
+    }
+
+    close(fd);
+  }
+
+  return -1;
+}
+
+void
+MockServerRun(int listen_fd)
+{
+  struct pollfd fds[MAX_CLIENTS + 1];
+  mock_client *polled[MAX_CLIENTS + 1];
+  const char *swap = getenv("MOCK_DRI2_SWAP");
+  const char *minor = getenv("MOCK_DRI2_MINOR");
+  mock_client *client;
+  int nfds;
+  int i;
+  ssize_t n;
+
+  signal(SIGPIPE, SIG_IGN);
+  dri2_minor = minor && *minor ? atoi(minor) : DRI2_MINOR;
+  swap_exchange = !swap || strcmp(swap, "copy");
+  swap_flip = getenv("MOCK_DRI2_FLIP") != NULL;
+  ignore_format = getenv("MOCK_DRI2_NO_FORMAT") != NULL;
+  no_shm = getenv("MOCK_NO_SHM") != NULL;
+
+  for (i = 0; i < MAX_CLIENTS; i++)
+    clients[i].fd = -1;
+
+  MockNewDrawable(ROOT_WINDOW, True, MockScreenWidth(), MockScreenHeight(),
+                  24);
+
+  for (;;)
+  {
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    nfds = 1;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+    {
+      if (clients[i].fd < 0)
+        continue;
+
+      fds[nfds].fd = clients[i].fd;
+      fds[nfds].events = POLLIN;
+      polled[nfds++] = &clients[i];
+    }
+
+    if (poll(fds, nfds, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      exit(1);
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int fd = accept(listen_fd, NULL, NULL);
+
+      for (i = 0; i < MAX_CLIENTS && fd >= 0; i++)
+      {
+        if (clients[i].fd < 0)
+        {
+          clients[i].fd = fd;
+          clients[i].rid_base = (i + 1) << 21;
+          fd = -1;
+        }
+      }
+
+      if (fd >= 0)
+        close(fd);
+    }
+
+    for (i = 1; i < nfds; i++)
+    {
+      client = polled[i];
+
+      if (!fds[i].revents)
+        continue;
+
+      if (client->in_size - client->in_len < 65536)
+      {
+        unsigned char *in = realloc(client->in, client->in_size + 65536);
+
+        if (!in)
+        {
+          MockDisconnect(client);
+          continue;
+        }
+
+        client->in = in;
+        client->in_size += 65536;
+      }
+
+      n = read(client->fd, client->in + client->in_len,
+               client->in_size - client->in_len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n <= 0)
+      {
+        MockDisconnect(client);
+        continue;
+      }
+
+      client->in_len += n;
+      MockProcess(client);
+
+      if (client->fd < 0)
+        MockDisconnect(client);
+    }
+  }
+}
+
+pid_t
+MockServerStart(void)
+{
+  char display_name[16];
+  pid_t server;
+  int display;
+  int fd;
+
+  fd = MockServerListen(&display);
+
+  if (fd < 0)
+    return -1;
+
+  server = fork();
+
+  if (!server)
+  {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    MockServerRun(fd);
+    _exit(0);
+  }
+
+  close(fd);
+
+  if (server > 0)
+  {
+    snprintf(display_name, sizeof(display_name), ":%d", display);
+    setenv("DISPLAY", display_name, 1);
+  }
+
+  return server;
+}
@@ -0,0 +1,187 @@
+/*
+ * Mock of the PVR2D API, as much of it as the plugin uses. The types and
+ * values follow the driver's pvr2d.h, mock_pvr2d.c implements the calls on
+ * plain memory.
+ */
+#ifndef _PVR2D_H_
+#define _PVR2D_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int PVR2D_INT;
+typedef unsigned int PVR2D_UINT;
+typedef long PVR2D_LONG;
+typedef unsigned long PVR2D_ULONG;
+typedef unsigned char PVR2D_UCHAR;
+typedef int PVR2D_BOOL;
+typedef void PVR2D_VOID;
+typedef void *PVR2D_HANDLE;
+
+#define PVR2D_TRUE 1
+#define PVR2D_FALSE 0
+
+typedef enum
+{
+  PVR2D_OK = 0,
+  PVR2DERROR_INVALID_PARAMETER = -1,
+  PVR2DERROR_DEVICE_UNAVAILABLE = -2,
+  PVR2DERROR_INVALID_CONTEXT = -3,
+  PVR2DERROR_MEMORY_UNAVAILABLE = -4,
+  PVR2DERROR_DEVICE_NOT_PRESENT = -5,
+  PVR2DERROR_IOCTL_ERROR = -6,
+  PVR2DERROR_GENERIC_ERROR = -7,
+  PVR2DERROR_BLT_NOTCOMPLETE = -8,
+  PVR2DERROR_HW_FEATURE_NOT_SUPPORTED = -9,
+  PVR2DERROR_NOT_YET_IMPLEMENTED = -10,
+  PVR2DERROR_MAPPING_FAILED = -11
+} PVR2DERROR;
+
+typedef unsigned long PVR2DFORMAT;
+
+#define PVR2D_1BPP 0x00UL
+#define PVR2D_RGB565 0x01UL
+#define PVR2D_ARGB4444 0x02UL
+#define PVR2D_RGB888 0x03UL
+#define PVR2D_ARGB8888 0x04UL
+#define PVR2D_ARGB1555 0x05UL
+#define PVR2D_ALPHA8 0x06UL
+#define PVR2D_ALPHA4 0x07UL
+#define PVR2D_ARGB2222 0x08UL
+#define PVR2D_YUV422_YUYV 0x09UL
+
+#define PVR2D_BLIT_DISABLE_ALL 0x00000000UL
+#define PVR2D_BLIT_ROT_90 0x00000020UL
+#define PVR2D_BLIT_ROT_180 0x00000040UL
+#define PVR2D_BLIT_ROT_270 0x00000080UL
+
+#define PVR2DROPcopy 0xCC
+
+#define PVR2D_CREATE_FLIPCHAIN_SHARED (1UL << 0)
+#define PVR2D_CREATE_FLIPCHAIN_QUERY (1UL << 1)
+
+#define PVR2D_MAX_DEVICE_NAME 20
+
+typedef struct _PVR2DMEMINFO
+{
+  PVR2D_VOID *hPrivateData;
+  PVR2D_ULONG ulFlags;
+  PVR2D_ULONG ui32DevAddr;
+  PVR2D_ULONG ui32MemSize;
+  PVR2D_VOID *pBase;
+} PVR2DMEMINFO, *PPVR2DMEMINFO;
+
+typedef struct
+{
+  PVR2D_ULONG ulDevID;
+  char szDeviceName[PVR2D_MAX_DEVICE_NAME];
+} PVR2DDEVICEINFO;
+
+typedef struct
+{
+  PVR2D_ULONG ulMaxFlipChains;
+  PVR2D_ULONG ulMaxBuffersInChain;
+  PVR2DFORMAT eFormat;
+  PVR2D_ULONG ulWidth;
+  PVR2D_ULONG ulHeight;
+  PVR2D_LONG lStride;
+  PVR2D_ULONG ulMinFlipInterval;
+  PVR2D_ULONG ulMaxFlipInterval;
+} PVR2DDISPLAYINFO;
+
+typedef struct
+{
+  PVR2D_LONG left;
+  PVR2D_LONG top;
+  PVR2D_LONG right;
+  PVR2D_LONG bottom;
+} PVR2DRECT;
+
+typedef struct _PVR2DBLTINFO
+{
+  PVR2D_ULONG CopyCode;
+  PVR2D_ULONG Colour;
+  PVR2D_ULONG ColourKey;
+  PVR2D_UCHAR GlobalAlphaValue;
+  PVR2D_UCHAR AlphaBlendingFunc;
+  PVR2D_ULONG BlitFlags;
+  PVR2DMEMINFO *pDstMemInfo;
+  PVR2D_ULONG DstOffset;
+  PVR2D_LONG DstStride;
+  PVR2D_LONG DstX, DstY;
+  PVR2D_LONG DSizeX, DSizeY;
+  PVR2DFORMAT DstFormat;
+  PVR2D_ULONG DstSurfWidth;
+  PVR2D_ULONG DstSurfHeight;
+  PVR2DMEMINFO *pSrcMemInfo;
+  PVR2D_ULONG SrcOffset;
+  PVR2D_LONG SrcStride;
+  PVR2D_LONG SrcX, SrcY;
+  PVR2D_LONG SizeX, SizeY;
+  PVR2DFORMAT SrcFormat;
+  PVR2D_ULONG SrcSurfWidth;
+  PVR2D_ULONG SrcSurfHeight;
+} PVR2DBLTINFO, *PPVR2DBLTINFO;
+
+typedef void *PVR2DCONTEXTHANDLE;
+typedef void *PVR2DFLIPCHAINHANDLE;
+
+int PVR2DEnumerateDevices(PVR2DDEVICEINFO *pDevInfo);
+PVR2DERROR PVR2DCreateDeviceContext(PVR2D_ULONG ulDevID,
+                                    PVR2DCONTEXTHANDLE *phContext,
+                                    PVR2D_ULONG ulFlags);
+PVR2DERROR PVR2DDestroyDeviceContext(PVR2DCONTEXTHANDLE hContext);
+PVR2DERROR PVR2DGetDeviceInfo(PVR2DCONTEXTHANDLE hContext,
+                              PVR2DDISPLAYINFO *pDisplayInfo);
+PVR2DERROR PVR2DGetFrameBuffer(PVR2DCONTEXTHANDLE hContext, PVR2D_INT nHeap,
+                               PVR2DMEMINFO **ppsMemInfo);
+PVR2DERROR PVR2DMemAlloc(PVR2DCONTEXTHANDLE hContext, PVR2D_ULONG ulBytes,
+                         PVR2D_ULONG ulAlign, PVR2D_ULONG ulFlags,
+                         PVR2DMEMINFO **ppsMemInfo);
+PVR2DERROR PVR2DMemWrap(PVR2DCONTEXTHANDLE hContext, PVR2D_VOID *pMem,
+                        PVR2D_ULONG ulFlags, PVR2D_ULONG ulBytes,
+                        PVR2D_ULONG alPageAddress[],
+                        PVR2DMEMINFO **ppsMemInfo);
+PVR2DERROR PVR2DMemFree(PVR2DCONTEXTHANDLE hContext,
+                        PVR2DMEMINFO *psMemInfo);
+PVR2DERROR PVR2DBlt(PVR2DCONTEXTHANDLE hContext, PVR2DBLTINFO *pBltInfo);
+PVR2DERROR PVR2DQueryBlitsComplete(PVR2DCONTEXTHANDLE hContext,
+                                   const PVR2DMEMINFO *pMemInfo,
+                                   PVR2D_UINT uiWaitForComplete);
+PVR2DERROR PVR2DCreateFlipChain(PVR2DCONTEXTHANDLE hContext,
+                                PVR2D_ULONG ulFlags, PVR2D_ULONG ulNumBuffers,
+                                PVR2D_ULONG ulWidth, PVR2D_ULONG ulHeight,
+                                PVR2DFORMAT eFormat, PVR2D_LONG *plStride,
+                                PVR2D_ULONG *pulFlipChainID,
+                                PVR2DFLIPCHAINHANDLE *phFlipChain);
+PVR2DERROR PVR2DDestroyFlipChain(PVR2DCONTEXTHANDLE hContext,
+                                 PVR2DFLIPCHAINHANDLE hFlipChain);
+PVR2DERROR PVR2DGetFlipChainBuffers(PVR2DCONTEXTHANDLE hContext,
+                                    PVR2DFLIPCHAINHANDLE hFlipChain,
+                                    PVR2D_ULONG *pulNumBuffers,
+                                    PVR2DMEMINFO *psMemInfo[]);
+PVR2DERROR PVR2DPresentFlip(PVR2DCONTEXTHANDLE hContext,
+                            PVR2DFLIPCHAINHANDLE hFlipChain,
+                            PVR2DMEMINFO *psMemInfo, PVR2D_LONG lRenderID);
+
+#define PVR2D_PRESENT_PROPERTY_SRCSTRIDE 0x00000001
+#define PVR2D_PRESENT_PROPERTY_DSTSIZE 0x00000002
+#define PVR2D_PRESENT_PROPERTY_DSTPOS 0x00000004
+#define PVR2D_PRESENT_PROPERTY_CLIPRECTS 0x00000008
+#define PVR2D_PRESENT_PROPERTY_INTERVAL 0x00000010
+
+PVR2DERROR PVR2DSetPresentFlipProperties(PVR2DCONTEXTHANDLE hContext,
+                                         PVR2DFLIPCHAINHANDLE hFlipChain,
+                                         PVR2D_ULONG ulPropertyMask,
+                                         PVR2D_LONG lDstXPos,
+                                         PVR2D_LONG lDstYPos,
+                                         PVR2D_ULONG ulNumClipRects,
+                                         PVR2DRECT *pClipRects,
+                                         PVR2D_ULONG ulSwapInterval);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Mock of the services app hint API. Hints are read from environment
+ * variables of the same name, WSEGL_ShmCacheKB=4096 say.
+ */
+#ifndef _SERVICES_H_
+#define _SERVICES_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned int IMG_UINT32;
+typedef int IMG_INT32;
+typedef char IMG_CHAR;
+typedef void IMG_VOID;
+typedef int IMG_BOOL;
+
+typedef enum
+{
+  IMG_EGL = 3
+} IMG_MODULE_ID;
+
+typedef enum
+{
+  IMG_STRING_TYPE = 1,
+  IMG_FLOAT_TYPE,
+  IMG_UINT_TYPE,
+  IMG_INT_TYPE,
+  IMG_FLAG_TYPE
+} IMG_DATA_TYPE;
+
+IMG_VOID PVRSRVCreateAppHintState(IMG_MODULE_ID eModuleID,
+                                  const IMG_CHAR *pszAppName,
+                                  IMG_VOID **ppvState);
+IMG_VOID PVRSRVFreeAppHintState(IMG_MODULE_ID eModuleID,
+                                IMG_VOID *pvHintState);
+IMG_BOOL PVRSRVGetAppHint(IMG_VOID *pvHintState, const IMG_CHAR *pszHintName,
+                          IMG_DATA_TYPE eDataType, const IMG_VOID *pvDefault,
+                          IMG_VOID *pvReturn);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,601 @@
+/*
+ * Drives the plugin through WSEGL_GetFunctionTablePointer() the way the EGL
+ * driver does, against the mock PVR2D and a stand-in X server forked off at
+ * start, and reports the cost of each scenario per frame:
+ *
+ *   swap      GetDrawableParameters and SwapDrawable on a window
+ *   damage    the same with a small damage rectangle set before each swap
+ *   resize    swaps with the window resized every BENCH_RESIZE_PERIOD frames
+ *   readback  a swap and a CopyFromDrawable of the window to a pixmap
+ *   pbuffer   CopyFromPBuffer of a window sized pbuffer to a pixmap
+ *   convert   the pixel conversion kernels on window sized frames, checked
+ *             against their scalar build and timed against it
+ *   flip      CopyFromPBuffer of 565 and 8888 pbuffers at common sizes,
+ *             checked and timed against a plain XPutImage with a negative
+ *             stride, which leaves flipping the rows to Xlib; set
+ *             MOCK_NO_SHM for the plugin's path without MIT-SHM
+ *
+ * ./wsegl_bench [scenario...], all of them by default. BENCH_FRAMES,
+ * BENCH_WIDTH and BENCH_HEIGHT set the frames per scenario and the window
+ * size, BENCH_FORMAT=565 renders the window in 16 bit and BENCH_SWAP_INTERVAL
+ * sets its swap interval, 1 by default. The MOCK_* variables of mock_pvr2d.c
+ * and mock_server.c set the latency and behaviour of the driver and the
+ * server, the WSEGL_* app hints those of the plugin.
+ */
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mock.h"
+#include "wsegldri2.h"
+
+typedef Window NativeWindowType;
+typedef Display * NativeDisplayType;
+typedef Drawable NativePixmapType;
+
+#include "wsegl.h"
+
+typedef struct
+{
+  const WSEGL_FunctionTable *table;
+  Display *dpy;
+  WSEGLDisplayHandle display;
+  WSEGLConfig *config;
+  Window window;
+  WSEGLDrawableHandle drawable;
+  Pixmap pixmap;
+  unsigned long width;
+  unsigned long height;
+  unsigned long frames;
+  unsigned long resize_period;
+  unsigned long swap_interval;
+} bench_state;
+
+typedef struct
+{
+  const char *name;
+  Bool (*frame)(bench_state *state, unsigned long frame);
+  /* Or the whole scenario, for those that don't need a window */
+  Bool (*run)(bench_state *state);
+} bench_scenario;
+
+static unsigned long
+BenchEnv(const char *name, unsigned long fallback)
+{
+  const char *value = getenv(name);
+
+  return value && *value ? strtoul(value, NULL, 0) : fallback;
+}
+
+static double
+BenchNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fetch the back buffer, touch it as the GPU would and swap it */
+static Bool
+BenchSwap(bench_state *state)
+{
+  WSEGLDrawableParams source;
+  WSEGLDrawableParams render;
+
+  if (state->table->pfnWSEGL_GetDrawableParameters(state->drawable, &source,
+                                                   &render) != WSEGL_SUCCESS)
+  {
+    return False;
+  }
+
+  if (render.pvLinearAddress)
+    memset(render.pvLinearAddress, 0x55, render.ui32Stride * 4);
+
+  return state->table->pfnWSEGL_SwapDrawable(state->drawable, 0) ==
+         WSEGL_SUCCESS;
+}
+
+static Bool
+BenchSwapFrame(bench_state *state, unsigned long frame)
+{
+  return BenchSwap(state);
+}
+
+static Bool
+BenchDamageFrame(bench_state *state, unsigned long frame)
+{
+  int rect[4] = { 16, 16, 64, 64 };
+
+  WSEGL_SetSwapDamage(state->dpy, state->window, rect, 1);
+
+  return BenchSwap(state);
+}
+
+static Bool
+BenchResizeFrame(bench_state *state, unsigned long frame)
+{
+  if (frame % state->resize_period == state->resize_period - 1)
+  {
+    unsigned long shrink = (frame / state->resize_period) % 2 ? 0 : 32;
+
+    XResizeWindow(state->dpy, state->window, state->width - shrink,
+                  state->height - shrink);
+    XFlush(state->dpy);
+  }
+
+  return BenchSwap(state);
+}
+
+static Bool
+BenchReadbackFrame(bench_state *state, unsigned long frame)
+{
+  if (!BenchSwap(state))
+    return False;
+
+  return state->table->pfnWSEGL_CopyFromDrawable(state->drawable,
+                                                 state->pixmap) ==
+         WSEGL_SUCCESS;
+}
+
+static Bool
+BenchPBufferFrame(bench_state *state, unsigned long frame)
+{
+  static void *pbuffer;
+
+  if (!pbuffer)
+    pbuffer = calloc(state->width * state->height, 4);
+
+  return pbuffer &&
+         state->table->pfnWSEGL_CopyFromPBuffer(pbuffer, state->width,
+                                                state->height, state->width,
+                                                WSEGL_PIXELFORMAT_8888,
+                                                state->pixmap) ==
+         WSEGL_SUCCESS;
+}
+
+/* Seconds taken by frames runs of kernel over a width x height frame */
+static double
+BenchConvertTime(ConvertKernel kernel, char *dst, unsigned long dst_bpp,
+                 const char *src, unsigned long src_bpp, unsigned long width,
+                 unsigned long height, unsigned long frames)
+{
+  double start = BenchNow();
+  unsigned long frame;
+  unsigned long y;
+
+  for (frame = 0; frame < frames; frame++)
+  {
+    for (y = 0; y < height; y++)
+      kernel(dst + y * width * dst_bpp, src + y * width * src_bpp, width);
+  }
+
+  return BenchNow() - start;
+}
+
+static Bool
+BenchConvert(bench_state *state)
+{
+  static const struct
+  {
+    const char *name;
+    unsigned long src_bpp;
+    unsigned long dst_bpp;
+  } kernels[CONVERT_KERNELS] =
+  {
+    { "565>8888", 2, 4 },
+    { "4444>8888", 2, 4 },
+    { "1555>8888", 2, 4 },
+    { "8888>565", 4, 2 }
+  };
+  unsigned long pixels = state->width * state->height;
+  unsigned long width;
+  unsigned long i;
+  double scalar;
+  double simd;
+  Bool ok = True;
+  char *src;
+  char *ref;
+  char *dst;
+  int k;
+
+  src = malloc(pixels * 4);
+  ref = malloc(pixels * 4);
+  dst = malloc(pixels * 4);
+
+  if (!src || !ref || !dst)
+  {
+    fputs("convert: out of memory\n", stderr);
+    free(src);
+    free(ref);
+    free(dst);
+    return False;
+  }
+
+  srand(1);
+
+  for (i = 0; i < pixels * 4; i++)
+    src[i] = rand();
+
+  for (k = 0; k < CONVERT_KERNELS; k++)
+  {
+    /* Every width up to a few vectors, to cover the scalar tails too */
+    for (width = 1; width <= 67 && ok; width++)
+    {
+      memset(ref, 0, width * 4);
+      memset(dst, 0xFF, width * 4);
+      ConvertScalar[k](ref, src, width);
+      ConvertSIMD[k](dst, src, width);
+      ok = !memcmp(ref, dst, width * kernels[k].dst_bpp);
+    }
+
+    scalar = BenchConvertTime(ConvertScalar[k], ref, kernels[k].dst_bpp, src,
+                              kernels[k].src_bpp, state->width, state->height,
+                              state->frames);
+    simd = BenchConvertTime(ConvertSIMD[k], dst, kernels[k].dst_bpp, src,
+                            kernels[k].src_bpp, state->width, state->height,
+                            state->frames);
+
+    if (!ok || memcmp(ref, dst, pixels * kernels[k].dst_bpp))
+    {
+      fprintf(stderr, "convert: %s differs from its scalar reference\n",
+              kernels[k].name);
+      ok = False;
+      break;
+    }
+
+    printf("%-9s %-9s %lux%lu %9.1f Mpixel/s scalar %9.1f Mpixel/s "
+           "SIMD %5.2fx\n", "convert", kernels[k].name, state->width,
+           state->height, pixels * state->frames / scalar / 1e6,
+           pixels * state->frames / simd / 1e6, scalar / simd);
+  }
+
+  free(src);
+  free(ref);
+  free(dst);
+
+  return ok;
+}
+
+/* Whether pixmap holds the bottom-up pbuffer the right way up */
+static Bool
+BenchFlipCheck(bench_state *state, Pixmap pixmap, const char *pbuffer,
+               unsigned long width, unsigned long height, unsigned long bpp)
+{
+  XImage *image;
+  unsigned long y;
+  Bool ok;
+
+  image = XGetImage(state->dpy, pixmap, 0, 0, width, height, AllPlanes,
+                    ZPixmap);
+
+  if (!image)
+    return False;
+
+  for (y = 0, ok = True; y < height && ok; y++)
+  {
+    ok = !memcmp(image->data + y * image->bytes_per_line,
+                 pbuffer + (height - 1 - y) * width * bpp, width * bpp);
+  }
+
+  XDestroyImage(image);
+
+  return ok;
+}
+
+static Bool
+BenchFlipRun(bench_state *state, WSEGLPixelFormat format, unsigned long width,
+             unsigned long height)
+{
+  unsigned int depth = format == WSEGL_PIXELFORMAT_565 ? 16 : 24;
+  unsigned long bpp = format == WSEGL_PIXELFORMAT_565 ? 2 : 4;
+  unsigned long size = width * height * bpp;
+  double put_image;
+  double plugin;
+  double start;
+  unsigned long frame;
+  unsigned long i;
+  XImage *image;
+  Pixmap pixmap;
+  char *pbuffer;
+  Bool ok;
+  GC gc;
+
+  pbuffer = malloc(size);
+
+  if (!pbuffer)
+    return False;
+
+  for (i = 0; i < size; i++)
+    pbuffer[i] = rand();
+
+  pixmap = XCreatePixmap(state->dpy, DefaultRootWindow(state->dpy), width,
+                         height, depth);
+  gc = XCreateGC(state->dpy, pixmap, 0, NULL);
+
+  /* The pbuffer as it is, Xlib reverses the rows into the request */
+  image = XCreateImage(state->dpy, DefaultVisual(state->dpy,
+                                                 DefaultScreen(state->dpy)),
+                       depth, ZPixmap, 0, NULL, width, height, 32,
+                       width * bpp);
+  image->data = pbuffer + (height - 1) * width * bpp;
+  image->bytes_per_line = -(int)(width * bpp);
+
+  start = BenchNow();
+
+  for (frame = 0; frame < state->frames; frame++)
+  {
+    XPutImage(state->dpy, pixmap, gc, image, 0, 0, 0, 0, width, height);
+    XSync(state->dpy, False);
+  }
+
+  put_image = BenchNow() - start;
+  ok = BenchFlipCheck(state, pixmap, pbuffer, width, height, bpp);
+
+  /* A fresh pixmap, so the check doesn't see the first copy */
+  XFreePixmap(state->dpy, pixmap);
+  pixmap = XCreatePixmap(state->dpy, DefaultRootWindow(state->dpy), width,
+                         height, depth);
+  start = BenchNow();
+
+  for (frame = 0; frame < state->frames && ok; frame++)
+  {
+    ok = state->table->pfnWSEGL_CopyFromPBuffer(pbuffer, width, height,
+                                                width, format, pixmap) ==
+         WSEGL_SUCCESS;
+    XSync(state->dpy, False);
+  }
+
+  plugin = BenchNow() - start;
+  ok = ok && BenchFlipCheck(state, pixmap, pbuffer, width, height, bpp);
+
+  image->data = NULL;
+  XDestroyImage(image);
+  XFreeGC(state->dpy, gc);
+  XFreePixmap(state->dpy, pixmap);
+  free(pbuffer);
+
+  if (!ok)
+  {
+    fprintf(stderr, "flip: %s %lux%lu pixmap doesn't match the pbuffer\n",
+            bpp == 2 ? "565" : "8888", width, height);
+    return False;
+  }
+
+  printf("%-9s %-9s %lux%lu %9.1f MB/s XPutImage %9.1f MB/s "
+         "CopyFromPBuffer %5.2fx\n", "flip", bpp == 2 ? "565" : "8888",
+         width, height, size * state->frames / put_image / 1e6,
+         size * state->frames / plugin / 1e6, put_image / plugin);
+
+  return True;
+}
+
+static Bool
+BenchFlip(bench_state *state)
+{
+  static const unsigned long sizes[][2] =
+  {
+    { 320, 240 }, { 640, 480 }, { 800, 480 }, { 1280, 720 }
+  };
+  Bool ok = True;
+  int i;
+
+  srand(1);
+
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+  {
+    ok = BenchFlipRun(state, WSEGL_PIXELFORMAT_565, sizes[i][0],
+                      sizes[i][1]) && ok;
+    ok = BenchFlipRun(state, WSEGL_PIXELFORMAT_8888, sizes[i][0],
+                      sizes[i][1]) && ok;
+  }
+
+  return ok;
+}
+
+static const bench_scenario scenarios[] =
+{
+  { "swap", BenchSwapFrame },
+  { "damage", BenchDamageFrame },
+  { "resize", BenchResizeFrame },
+  { "readback", BenchReadbackFrame },
+  { "pbuffer", BenchPBufferFrame },
+  { "convert", NULL, BenchConvert },
+  { "flip", NULL, BenchFlip }
+};
+
+static Bool
+BenchCreateDrawables(bench_state *state)
+{
+  WSEGLRotationAngle rotation;
+
+  state->window = XCreateSimpleWindow(state->dpy, DefaultRootWindow(state->dpy),
+                                      0, 0, state->width, state->height, 0, 0,
+                                      0);
+  XMapWindow(state->dpy, state->window);
+  state->pixmap = XCreatePixmap(state->dpy, DefaultRootWindow(state->dpy),
+                                state->width, state->height, 24);
+
+  return state->table->pfnWSEGL_CreateWindowDrawable(state->display,
+                                                     state->config,
+                                                     &state->drawable,
+                                                     state->window,
+                                                     &rotation) ==
+         WSEGL_SUCCESS &&
+         state->table->pfnWSEGL_SwapControlInterval(state->drawable,
+                                                    state->swap_interval) ==
+         WSEGL_SUCCESS;
+}
+
+static void
+BenchDestroyDrawables(bench_state *state)
+{
+  state->table->pfnWSEGL_DeleteDrawable(state->drawable);
+  XFreePixmap(state->dpy, state->pixmap);
+  XDestroyWindow(state->dpy, state->window);
+  XSync(state->dpy, False);
+}
+
+/* Each scenario starts from a fresh window, so resizes don't carry over */
+static Bool
+BenchRun(bench_state *state, const bench_scenario *scenario)
+{
+  WSEGLDRI2Statistics stats;
+  unsigned long frame;
+  double start;
+  double elapsed;
+  XEvent event;
+
+  if (!BenchCreateDrawables(state))
+  {
+    fprintf(stderr, "%s: cannot create the window drawable\n",
+            scenario->name);
+    return False;
+  }
+
+  WSEGL_ResetStatistics();
+  start = BenchNow();
+
+  for (frame = 0; frame < state->frames; frame++)
+  {
+    if (!scenario->frame(state, frame))
+    {
+      fprintf(stderr, "%s: frame %lu failed\n", scenario->name, frame);
+      BenchDestroyDrawables(state);
+      return False;
+    }
+
+    /* Nothing is selected, but don't let anything pile up in the queue */
+    while (XPending(state->dpy))
+      XNextEvent(state->dpy, &event);
+  }
+
+  elapsed = BenchNow() - start;
+  WSEGL_GetStatistics(&stats);
+  BenchDestroyDrawables(state);
+
+  printf("%-9s %7lu frames %9.1f fps %6.2f round trips/frame "
+         "%6.2f allocations/frame %6llu mem wraps %10.0f bytes copied/frame\n",
+         scenario->name, state->frames, state->frames / elapsed,
+         (double)stats.round_trips / state->frames,
+         (double)stats.allocations / state->frames, stats.mem_wraps,
+         (double)stats.bytes_copied / state->frames);
+
+  return True;
+}
+
+int
+main(int argc, char **argv)
+{
+  bench_state state;
+  const char *format = getenv("BENCH_FORMAT");
+  WSEGLPixelFormat pixel_format = WSEGL_PIXELFORMAT_8888;
+  const WSEGLCaps *caps;
+  WSEGLConfig *config;
+  pid_t server;
+  int status = 0;
+  int i;
+  int j;
+
+  memset(&state, 0, sizeof(state));
+  state.frames = BenchEnv("BENCH_FRAMES", 1000);
+  state.width = BenchEnv("BENCH_WIDTH", 640);
+  state.height = BenchEnv("BENCH_HEIGHT", 480);
+  state.resize_period = BenchEnv("BENCH_RESIZE_PERIOD", 10);
+  state.swap_interval = BenchEnv("BENCH_SWAP_INTERVAL", 1);
+
+  if (format && !strcmp(format, "565"))
+    pixel_format = WSEGL_PIXELFORMAT_565;
+
+  if (!state.frames || !state.resize_period || state.width <= 32 ||
+      state.height <= 32)
+  {
+    fputs("BENCH_* out of range\n", stderr);
+    return 1;
+  }
+
+  server = MockServerStart();
+
+  if (server < 0)
+  {
+    perror("cannot start the X server");
+    return 1;
+  }
+
+  XInitThreads();
+  state.dpy = XOpenDisplay(NULL);
+
+  if (!state.dpy)
+  {
+    fprintf(stderr, "cannot open display %s\n", getenv("DISPLAY"));
+    status = 1;
+    goto kill_server;
+  }
+
+  state.table = WSEGL_GetFunctionTablePointer();
+
+  if (state.table->pfnWSEGL_IsDisplayValid(state.dpy) != WSEGL_SUCCESS ||
+      state.table->pfnWSEGL_InitialiseDisplay(state.dpy, &state.display,
+                                              &caps, &config) !=
+      WSEGL_SUCCESS)
+  {
+    fputs("cannot initialise the display\n", stderr);
+    status = 1;
+    goto close_display;
+  }
+
+  for (; config->ui32DrawableType; config++)
+  {
+    if ((config->ui32DrawableType & WSEGL_DRAWABLE_WINDOW) &&
+        config->ePixelFormat == pixel_format &&
+        config->ulNativeVisualID ==
+        XVisualIDFromVisual(DefaultVisual(state.dpy, DefaultScreen(state.dpy))))
+    {
+      state.config = config;
+      break;
+    }
+  }
+
+  if (!state.config)
+  {
+    fprintf(stderr, "no %s window config\n",
+            pixel_format == WSEGL_PIXELFORMAT_565 ? "565" : "8888");
+    status = 1;
+    goto close_wsegl;
+  }
+
+  for (i = 0; i < (int)(sizeof(scenarios) / sizeof(scenarios[0])); i++)
+  {
+    for (j = 1; j < argc && strcmp(argv[j], scenarios[i].name); j++)
+      ;
+
+    if (argc > 1 && j == argc)
+      continue;
+
+    if (scenarios[i].run ? !scenarios[i].run(&state) :
+        !BenchRun(&state, &scenarios[i]))
+    {
+      status = 1;
+    }
+  }
+
+close_wsegl:
+  state.table->pfnWSEGL_CloseDisplay(state.display);
+
+close_display:
+  XCloseDisplay(state.dpy);
+
+kill_server:
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+
+  return status;
+}
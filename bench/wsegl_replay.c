@@ -0,0 +1,677 @@
+/*
+ * Feeds a session recorded with the WSEGL_RecordFile app hint back through
+ * the plugin, against the mock PVR2D and a stand-in X server forked off at
+ * start, and reports for each function of the table its calls, their mean
+ * time when recorded and when replayed, and how many came out differently:
+ * with another result, rotation, or drawable size, stride or format.
+ *
+ *   ./wsegl_replay file
+ *
+ * The calls are replayed in file order on one thread, as fast as they go.
+ * Connections, displays, drawables and configs map to the ones the replay
+ * creates. Windows and pixmaps get the size their DRI2 buffers had in the
+ * recording and windows follow its resizes; pixmaps copied to and pbuffers
+ * are blank. The MOCK_* variables and WSEGL_* app hints work as for
+ * wsegl_bench.
+ */
+#include <X11/Xlib.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "mock.h"
+#include "wsegldri2.h"
+
+typedef Window NativeWindowType;
+typedef Display * NativeDisplayType;
+typedef Drawable NativePixmapType;
+
+#include "wsegl.h"
+
+/* Sizes are kept as one number */
+#define REPLAY_SIZE(width, height) ((uint64_t)(width) << 32 | (height))
+
+/* Something of the recording and what stands in for it in the replay */
+typedef struct
+{
+  uint64_t recorded;
+  uint64_t replayed;
+  /* The configs of a display, the XID of a drawable, the size of a window */
+  uint64_t extra;
+} replay_entry;
+
+typedef struct
+{
+  replay_entry *entries;
+  unsigned long count;
+} replay_map;
+
+typedef struct
+{
+  unsigned long calls;
+  unsigned long mismatches;
+  double recorded_ns;
+  double replayed_ns;
+} replay_stats;
+
+typedef struct
+{
+  const WSEGL_FunctionTable *table;
+  Display *dpy;
+  replay_map connections;
+  replay_map displays;
+  replay_map drawables;
+  replay_map windows;
+  replay_map pixmaps;
+  /* Size of the first DRI2 buffers of each recorded drawable */
+  replay_map sizes;
+  char *pbuffer;
+  size_t pbuffer_size;
+  replay_stats stats[WSEGLDRI2_STAT_NUM_FUNCTIONS];
+  unsigned long skipped;
+  unsigned long pvr2d_calls;
+  unsigned long buffers_replies;
+} replay_state;
+
+static const char *const function_names[WSEGLDRI2_STAT_NUM_FUNCTIONS] =
+{
+  "IsDisplayValid",
+  "InitialiseDisplay",
+  "CloseDisplay",
+  "CreateWindowDrawable",
+  "CreatePixmapDrawable",
+  "DeleteDrawable",
+  "SwapDrawable",
+  "SwapControlInterval",
+  "WaitNative",
+  "CopyFromDrawable",
+  "CopyFromPBuffer",
+  "GetDrawableParameters"
+};
+
+static double
+ReplayNow(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static replay_entry *
+ReplayFind(replay_map *map, uint64_t recorded)
+{
+  unsigned long i;
+
+  for (i = 0; i < map->count; i++)
+  {
+    if (map->entries[i].recorded == recorded)
+      return &map->entries[i];
+  }
+
+  return NULL;
+}
+
+static replay_entry *
+ReplayAdd(replay_map *map, uint64_t recorded, uint64_t replayed,
+          uint64_t extra)
+{
+  replay_entry *entries;
+  replay_entry *entry = ReplayFind(map, recorded);
+
+  if (!entry)
+  {
+    entries = realloc(map->entries, (map->count + 1) * sizeof(*entries));
+
+    if (!entries)
+      return NULL;
+
+    map->entries = entries;
+    entry = &entries[map->count++];
+    entry->recorded = recorded;
+  }
+
+  entry->replayed = replayed;
+  entry->extra = extra;
+
+  return entry;
+}
+
+static void
+ReplayRemove(replay_map *map, replay_entry *entry)
+{
+  *entry = map->entries[--map->count];
+}
+
+static unsigned int
+ReplayDepth(uint32_t pixel_format)
+{
+  return pixel_format == WSEGL_PIXELFORMAT_8888 ? 24 : 16;
+}
+
+/* A connection of our own for each the recorded process had, NULL stays */
+static Display *
+ReplayConnection(replay_state *state, uint64_t recorded)
+{
+  replay_entry *entry;
+  Display *dpy;
+
+  if (!recorded)
+    return NULL;
+
+  entry = ReplayFind(&state->connections, recorded);
+
+  if (entry)
+    return (Display *)(uintptr_t)entry->replayed;
+
+  dpy = XOpenDisplay(NULL);
+
+  if (dpy && !ReplayAdd(&state->connections, recorded, (uintptr_t)dpy, 0))
+  {
+    XCloseDisplay(dpy);
+    dpy = NULL;
+  }
+
+  return dpy;
+}
+
+/*
+ * The window or pixmap standing in for a recorded XID, created with the
+ * size of its first DRI2 buffers, or the given one.
+ */
+static Drawable
+ReplayNative(replay_state *state, uint64_t xid, Bool window,
+             unsigned int depth, unsigned long width, unsigned long height)
+{
+  replay_map *map = window ? &state->windows : &state->pixmaps;
+  replay_entry *entry = ReplayFind(map, xid);
+  Drawable drawable;
+
+  if (entry)
+    return entry->replayed;
+
+  entry = ReplayFind(&state->sizes, xid);
+
+  if (entry)
+  {
+    width = entry->extra >> 32;
+    height = entry->extra & 0xFFFFFFFF;
+  }
+
+  if (window)
+  {
+    drawable = XCreateSimpleWindow(state->dpy, DefaultRootWindow(state->dpy),
+                                   0, 0, width, height, 0, 0, 0);
+    XMapWindow(state->dpy, drawable);
+  }
+  else
+  {
+    drawable = XCreatePixmap(state->dpy, DefaultRootWindow(state->dpy), width,
+                             height, depth);
+  }
+
+  /* The plugin talks to the server on other connections */
+  XSync(state->dpy, False);
+
+  if (!ReplayAdd(map, xid, drawable, REPLAY_SIZE(width, height)))
+    return None;
+
+  return drawable;
+}
+
+/* The first of the display's configs that renders the same */
+static WSEGLConfig *
+ReplayConfig(replay_entry *display, const WSEGLDRI2RecordConfig *recorded)
+{
+  WSEGLConfig *config = (WSEGLConfig *)(uintptr_t)display->extra;
+
+  for (; config && config->ui32DrawableType; config++)
+  {
+    if (config->ui32DrawableType == recorded->drawable_type &&
+        config->ePixelFormat == recorded->pixel_format &&
+        config->ulNativeRenderable == recorded->native_renderable &&
+        config->ulFrameBufferLevel == recorded->frame_buffer_level)
+    {
+      return config;
+    }
+  }
+
+  return NULL;
+}
+
+static Bool
+ReplaySameParams(const WSEGLDRI2RecordParams *recorded,
+                 const WSEGLDrawableParams *replayed)
+{
+  return recorded->width == replayed->ui32Width &&
+         recorded->height == replayed->ui32Height &&
+         recorded->stride == replayed->ui32Stride &&
+         recorded->pixel_format == replayed->ePixelFormat;
+}
+
+/* Before the call that collected it, resize the window to the reply's size */
+static void
+ReplayBuffers(replay_state *state, const char *payload)
+{
+  WSEGLDRI2RecordBuffers reply;
+  replay_entry *window;
+  unsigned long i;
+
+  memcpy(&reply, payload, sizeof(reply));
+  state->buffers_replies++;
+  window = ReplayFind(&state->windows, reply.drawable);
+
+  if (!window || reply.width <= 0 || reply.height <= 0 ||
+      window->extra == REPLAY_SIZE(reply.width, reply.height))
+  {
+    return;
+  }
+
+  XResizeWindow(state->dpy, window->replayed, reply.width, reply.height);
+  XSync(state->dpy, False);
+  window->extra = REPLAY_SIZE(reply.width, reply.height);
+
+  /* Have the plugin see the invalidate event before the call, as it did */
+  for (i = 0; i < state->connections.count; i++)
+    XSync((Display *)(uintptr_t)state->connections.entries[i].replayed, False);
+}
+
+/* Takes args[] as recorded, followed by the outs, and the structures */
+static void
+ReplayCall(replay_state *state, const WSEGLDRI2RecordCall *call,
+           const uint64_t *args, const char *structs, size_t structs_size)
+{
+  const WSEGL_FunctionTable *table = state->table;
+  const uint64_t *outs = args + call->num_args;
+  replay_entry *entry = NULL;
+  WSEGLDRI2RecordConfig recorded_config;
+  WSEGLDRI2RecordParams recorded_params[2];
+  WSEGLDrawableParams source;
+  WSEGLDrawableParams render;
+  WSEGLDisplayHandle display;
+  WSEGLDrawableHandle drawable;
+  WSEGLRotationAngle rotation;
+  const WSEGLCaps *caps;
+  WSEGLConfig *configs;
+  WSEGLConfig *config;
+  Drawable native;
+  Bool same = True;
+  WSEGLError rv;
+  double start;
+  size_t size;
+
+  /* Everything but the connection and pbuffer calls takes a handle first */
+  if (call->function != WSEGLDRI2_STAT_IS_DISPLAY_VALID &&
+      call->function != WSEGLDRI2_STAT_INITIALISE_DISPLAY &&
+      call->function != WSEGLDRI2_STAT_COPY_FROM_PBUFFER)
+  {
+    entry = ReplayFind(call->function <= WSEGLDRI2_STAT_CREATE_PIXMAP_DRAWABLE ?
+                       &state->displays : &state->drawables, args[0]);
+
+    /* Nothing to replay it on, the recorded call failed or came before */
+    if (!entry)
+    {
+      state->skipped++;
+      return;
+    }
+  }
+
+  start = ReplayNow();
+
+  switch (call->function)
+  {
+    case WSEGLDRI2_STAT_IS_DISPLAY_VALID:
+      rv = table->pfnWSEGL_IsDisplayValid(ReplayConnection(state, args[0]));
+      break;
+    case WSEGLDRI2_STAT_INITIALISE_DISPLAY:
+      rv = table->pfnWSEGL_InitialiseDisplay(ReplayConnection(state, args[0]),
+                                             &display, &caps, &configs);
+
+      if (rv == WSEGL_SUCCESS && call->result == WSEGL_SUCCESS)
+      {
+        ReplayAdd(&state->displays, outs[0], (uintptr_t)display,
+                  (uintptr_t)configs);
+      }
+
+      break;
+    case WSEGLDRI2_STAT_CLOSE_DISPLAY:
+      rv = table->pfnWSEGL_CloseDisplay((WSEGLDisplayHandle)(uintptr_t)
+                                        entry->replayed);
+      ReplayRemove(&state->displays, entry);
+      break;
+    case WSEGLDRI2_STAT_CREATE_WINDOW_DRAWABLE:
+    case WSEGLDRI2_STAT_CREATE_PIXMAP_DRAWABLE:
+      if (structs_size < sizeof(recorded_config))
+      {
+        state->skipped++;
+        return;
+      }
+
+      memcpy(&recorded_config, structs, sizeof(recorded_config));
+      config = ReplayConfig(entry, &recorded_config);
+
+      if (!config)
+      {
+        state->skipped++;
+        return;
+      }
+
+      if (call->function == WSEGLDRI2_STAT_CREATE_WINDOW_DRAWABLE)
+      {
+        native = ReplayNative(state, args[2], True, 0,
+                              DisplayWidth(state->dpy, 0),
+                              DisplayHeight(state->dpy, 0));
+        start = ReplayNow();
+        rv = table->pfnWSEGL_CreateWindowDrawable(
+                 (WSEGLDisplayHandle)(uintptr_t)entry->replayed, config,
+                 &drawable, native, &rotation);
+      }
+      else
+      {
+        native = ReplayNative(state, args[2], False,
+                              ReplayDepth(config->ePixelFormat),
+                              DisplayWidth(state->dpy, 0),
+                              DisplayHeight(state->dpy, 0));
+        start = ReplayNow();
+        rv = table->pfnWSEGL_CreatePixmapDrawable(
+                 (WSEGLDisplayHandle)(uintptr_t)entry->replayed, config,
+                 &drawable, native, &rotation);
+      }
+
+      if (rv == WSEGL_SUCCESS && call->result == WSEGL_SUCCESS)
+      {
+        same = rotation == outs[1];
+        ReplayAdd(&state->drawables, outs[0], (uintptr_t)drawable, args[2]);
+      }
+
+      break;
+    case WSEGLDRI2_STAT_DELETE_DRAWABLE:
+      rv = table->pfnWSEGL_DeleteDrawable((WSEGLDrawableHandle)(uintptr_t)
+                                          entry->replayed);
+      ReplayRemove(&state->drawables, entry);
+      break;
+    case WSEGLDRI2_STAT_SWAP_DRAWABLE:
+      rv = table->pfnWSEGL_SwapDrawable((WSEGLDrawableHandle)(uintptr_t)
+                                        entry->replayed, args[1]);
+      break;
+    case WSEGLDRI2_STAT_SWAP_CONTROL_INTERVAL:
+      rv = table->pfnWSEGL_SwapControlInterval((WSEGLDrawableHandle)
+                                               (uintptr_t)entry->replayed,
+                                               args[1]);
+      break;
+    case WSEGLDRI2_STAT_WAIT_NATIVE:
+      rv = table->pfnWSEGL_WaitNative((WSEGLDrawableHandle)(uintptr_t)
+                                      entry->replayed, args[1]);
+      break;
+    case WSEGLDRI2_STAT_COPY_FROM_DRAWABLE:
+    {
+      replay_entry *window = ReplayFind(&state->windows, entry->extra);
+      uint64_t window_size = window ? window->extra :
+                             REPLAY_SIZE(DisplayWidth(state->dpy, 0),
+                                         DisplayHeight(state->dpy, 0));
+
+      native = ReplayNative(state, args[1], False, 24, window_size >> 32,
+                            window_size & 0xFFFFFFFF);
+      start = ReplayNow();
+      rv = table->pfnWSEGL_CopyFromDrawable((WSEGLDrawableHandle)(uintptr_t)
+                                            entry->replayed, native);
+      break;
+    }
+    case WSEGLDRI2_STAT_COPY_FROM_PBUFFER:
+      size = args[3] * args[2] * (args[4] == WSEGL_PIXELFORMAT_8888 ? 4 : 2);
+
+      if (state->pbuffer_size < size)
+      {
+        free(state->pbuffer);
+        state->pbuffer = calloc(size, 1);
+        state->pbuffer_size = state->pbuffer ? size : 0;
+      }
+
+      if (!state->pbuffer || !args[1] || !args[2])
+      {
+        state->skipped++;
+        return;
+      }
+
+      native = ReplayNative(state, args[5], False, ReplayDepth(args[4]),
+                            args[1], args[2]);
+      start = ReplayNow();
+      rv = table->pfnWSEGL_CopyFromPBuffer(state->pbuffer, args[1], args[2],
+                                           args[3], args[4], native);
+      break;
+    case WSEGLDRI2_STAT_GET_DRAWABLE_PARAMETERS:
+      rv = table->pfnWSEGL_GetDrawableParameters((WSEGLDrawableHandle)
+                                                 (uintptr_t)entry->replayed,
+                                                 &source, &render);
+
+      if (rv == WSEGL_SUCCESS && call->result == WSEGL_SUCCESS &&
+          structs_size >= sizeof(recorded_params))
+      {
+        memcpy(recorded_params, structs, sizeof(recorded_params));
+        same = ReplaySameParams(&recorded_params[0], &source) &&
+               ReplaySameParams(&recorded_params[1], &render);
+      }
+
+      break;
+    default:
+      state->skipped++;
+      return;
+  }
+
+  state->stats[call->function].replayed_ns += ReplayNow() - start;
+  state->stats[call->function].recorded_ns += call->duration_ns;
+  state->stats[call->function].calls++;
+
+  if (rv != call->result || !same)
+    state->stats[call->function].mismatches++;
+}
+
+static Bool
+ReplayFile(replay_state *state, const char *data, size_t size)
+{
+  WSEGLDRI2RecordHeader header;
+  WSEGLDRI2RecordBuffers reply;
+  WSEGLDRI2RecordCall call;
+  uint32_t magic[2];
+  size_t offset;
+  int pass;
+
+  if (size >= sizeof(magic))
+    memcpy(magic, data, sizeof(magic));
+
+  if (size < sizeof(magic) || magic[0] != WSEGLDRI2_RECORD_MAGIC ||
+      magic[1] != WSEGLDRI2_RECORD_VERSION)
+  {
+    fprintf(stderr, "not a version %d WSEGL recording\n",
+            WSEGLDRI2_RECORD_VERSION);
+    return False;
+  }
+
+  /* The first pass only learns the size of every drawable */
+  for (pass = 0; pass < 2; pass++)
+  {
+    for (offset = sizeof(magic); offset + sizeof(header) <= size;
+         offset += sizeof(header) + header.size)
+    {
+      const char *payload = data + offset + sizeof(header);
+
+      memcpy(&header, data + offset, sizeof(header));
+
+      if (header.size > size - offset - sizeof(header))
+      {
+        fputs("recording cut short\n", stderr);
+        break;
+      }
+
+      if (header.type == WSEGLDRI2_RECORD_BUFFERS &&
+          header.size >= sizeof(reply))
+      {
+        memcpy(&reply, payload, sizeof(reply));
+
+        if (pass)
+          ReplayBuffers(state, payload);
+        else if (!ReplayFind(&state->sizes, reply.drawable) &&
+                 reply.width > 0 && reply.height > 0)
+        {
+          ReplayAdd(&state->sizes, reply.drawable, 0,
+                    REPLAY_SIZE(reply.width, reply.height));
+        }
+      }
+      else if (header.type == WSEGLDRI2_RECORD_PVR2D && pass)
+        state->pvr2d_calls++;
+      else if (header.type == WSEGLDRI2_RECORD_CALL && pass &&
+               header.size >= sizeof(call))
+      {
+        size_t args_size;
+
+        memcpy(&call, payload, sizeof(call));
+        args_size = (call.num_args + call.num_outs) * sizeof(uint64_t);
+
+        if (args_size <= header.size - sizeof(call))
+        {
+          uint64_t args[call.num_args + call.num_outs + 1];
+
+          memcpy(args, payload + sizeof(call), args_size);
+          ReplayCall(state, &call, args, payload + sizeof(call) + args_size,
+                     header.size - sizeof(call) - args_size);
+        }
+      }
+    }
+  }
+
+  return True;
+}
+
+static void
+ReplayReport(replay_state *state)
+{
+  replay_stats *stats;
+  int i;
+
+  printf("%-22s %8s %14s %14s %10s\n", "function", "calls", "recorded us",
+         "replayed us", "mismatches");
+
+  for (i = 0; i < WSEGLDRI2_STAT_NUM_FUNCTIONS; i++)
+  {
+    stats = &state->stats[i];
+
+    if (!stats->calls)
+      continue;
+
+    printf("%-22s %8lu %14.1f %14.1f %10lu\n", function_names[i],
+           stats->calls, stats->recorded_ns / stats->calls / 1e3,
+           stats->replayed_ns / stats->calls / 1e3, stats->mismatches);
+  }
+
+  printf("%lu calls skipped, %lu DRI2GetBuffers replies and %lu PVR2D calls "
+         "recorded\n", state->skipped, state->buffers_replies,
+         state->pvr2d_calls);
+}
+
+static char *
+ReplayRead(const char *path, size_t *size)
+{
+  FILE *file = fopen(path, "rb");
+  char *data = NULL;
+  long length;
+
+  if (!file)
+    return NULL;
+
+  if (!fseek(file, 0, SEEK_END) && (length = ftell(file)) >= 0 &&
+      !fseek(file, 0, SEEK_SET) && (data = malloc(length + 1)) &&
+      fread(data, 1, length, file) == (size_t)length)
+  {
+    *size = length;
+  }
+  else
+  {
+    free(data);
+    data = NULL;
+  }
+
+  fclose(file);
+
+  return data;
+}
+
+int
+main(int argc, char **argv)
+{
+  replay_state state;
+  pid_t server;
+  char *data;
+  size_t size;
+  int status = 0;
+  unsigned long i;
+
+  if (argc != 2)
+  {
+    fputs("usage: wsegl_replay file\n", stderr);
+    return 1;
+  }
+
+  data = ReplayRead(argv[1], &size);
+
+  if (!data)
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  memset(&state, 0, sizeof(state));
+  server = MockServerStart();
+
+  if (server < 0)
+  {
+    perror("cannot start the X server");
+    return 1;
+  }
+
+  XInitThreads();
+  state.dpy = XOpenDisplay(NULL);
+
+  if (!state.dpy)
+  {
+    fprintf(stderr, "cannot open display %s\n", getenv("DISPLAY"));
+    status = 1;
+    goto kill_server;
+  }
+
+  state.table = WSEGL_GetFunctionTablePointer();
+
+  if (ReplayFile(&state, data, size))
+    ReplayReport(&state);
+  else
+    status = 1;
+
+  /* What the recording left open */
+  for (i = 0; i < state.drawables.count; i++)
+  {
+    state.table->pfnWSEGL_DeleteDrawable((WSEGLDrawableHandle)(uintptr_t)
+                                         state.drawables.entries[i].replayed);
+  }
+
+  for (i = 0; i < state.displays.count; i++)
+  {
+    state.table->pfnWSEGL_CloseDisplay((WSEGLDisplayHandle)(uintptr_t)
+                                       state.displays.entries[i].replayed);
+  }
+
+  for (i = 0; i < state.connections.count; i++)
+    XCloseDisplay((Display *)(uintptr_t)state.connections.entries[i].replayed);
+
+  XCloseDisplay(state.dpy);
+
+kill_server:
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  free(data);
+
+  return status;
+}
@@ -0,0 +1,92 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+#include <stdint.h>
+
+/*
+ * Pixel conversion kernels, one row of width pixels each. They are kept
+ * branch-free over plain uint16_t and uint32_t arrays so that gcc turns them
+ * into NEON on ARM and SSE2 on x86, but only with the vectorizer on: gcc
+ * before 12 leaves it off at -O2 and gcc 12 runs it with a cost model that
+ * gives up on them, so it is forced on for these functions. Defining
+ * WSEGLDRI2_CONVERT_SCALAR forces it off instead, for the scalar reference
+ * the bench checks the SIMD code against.
+ */
+#if defined(WSEGLDRI2_CONVERT_SCALAR)
+#define WSEGLDRI2_CONVERT __attribute__((optimize("no-tree-vectorize")))
+#elif defined(__GNUC__) && !defined(__clang__)
+#define WSEGLDRI2_CONVERT __attribute__((optimize("tree-vectorize")))
+#else
+#define WSEGLDRI2_CONVERT
+#endif
+
+static WSEGLDRI2_CONVERT void
+WSEGLDRI2Convert565To8888(char *dst, const char *src, unsigned long width)
+{
+  const uint16_t *s = (const uint16_t *)src;
+  uint32_t *d = (uint32_t *)dst;
+  unsigned long i;
+
+  for (i = 0; i < width; i++)
+  {
+    uint32_t r = (s[i] >> 11) & 0x1F;
+    uint32_t g = (s[i] >> 5) & 0x3F;
+    uint32_t b = s[i] & 0x1F;
+
+    d[i] = 0xFF000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) |
+           (b << 3 | b >> 2);
+  }
+}
+
+static WSEGLDRI2_CONVERT void
+WSEGLDRI2Convert4444To8888(char *dst, const char *src, unsigned long width)
+{
+  const uint16_t *s = (const uint16_t *)src;
+  uint32_t *d = (uint32_t *)dst;
+  unsigned long i;
+
+  for (i = 0; i < width; i++)
+  {
+    uint32_t a = (s[i] >> 12) & 0xF;
+    uint32_t r = (s[i] >> 8) & 0xF;
+    uint32_t g = (s[i] >> 4) & 0xF;
+    uint32_t b = s[i] & 0xF;
+
+    d[i] = (a * 0x11) << 24 | (r * 0x11) << 16 | (g * 0x11) << 8 | b * 0x11;
+  }
+}
+
+static WSEGLDRI2_CONVERT void
+WSEGLDRI2Convert1555To8888(char *dst, const char *src, unsigned long width)
+{
+  const uint16_t *s = (const uint16_t *)src;
+  uint32_t *d = (uint32_t *)dst;
+  unsigned long i;
+
+  for (i = 0; i < width; i++)
+  {
+    uint32_t a = (s[i] >> 15) & 0x1;
+    uint32_t r = (s[i] >> 10) & 0x1F;
+    uint32_t g = (s[i] >> 5) & 0x1F;
+    uint32_t b = s[i] & 0x1F;
+
+    d[i] = (a * 0xFF) << 24 | (r << 3 | r >> 2) << 16 | (g << 3 | g >> 2) << 8 |
+           (b << 3 | b >> 2);
+  }
+}
+
+static WSEGLDRI2_CONVERT void
+WSEGLDRI2Convert8888To565(char *dst, const char *src, unsigned long width)
+{
+  const uint32_t *s = (const uint32_t *)src;
+  uint16_t *d = (uint16_t *)dst;
+  unsigned long i;
+
+  for (i = 0; i < width; i++)
+  {
+    d[i] = ((s[i] >> 8) & 0xF800) | ((s[i] >> 5) & 0x7E0) |
+           ((s[i] >> 3) & 0x1F);
+  }
+}
+
+#endif
@@ -1,10 +1,14 @@
 #include <stdint.h>
+#include <sys/uio.h>
 #include <X11/Xlibint.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/extensions/extutil.h>
 #include <X11/extensions/dri2proto.h>
 #include <X11/extensions/Xfixes.h>
 #include <drm.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 
 #include "dri2.h"
 
@@ -14,6 +18,8 @@ static XExtensionInfo *dri2Info = NULL;
 
 static XEXT_GENERATE_CLOSE_DISPLAY(DRI2CloseDisplay, dri2Info);
 
+static Bool DRI2WireToEvent(Display *dpy, XEvent *event, xEvent *wire);
+
 static Bool
 DRI2Error(Display *dpy, xError *err, XExtCodes *codes, int *ret_code)
 {
@@ -37,7 +43,7 @@ static XExtensionHooks dri2ExtensionHooks = {
   NULL,
   NULL,
   DRI2CloseDisplay,
-  NULL,
+  DRI2WireToEvent,
   NULL,
   DRI2Error,
   NULL
@@ -47,27 +53,106 @@ static XEXT_GENERATE_FIND_DISPLAY(DRI2FindDisplay,
                                   dri2Info,
                                   dri2ExtensionName,
                                   &dri2ExtensionHooks,
-                                  0, NULL);
+                                  DRI2NumberEvents, NULL);
 
-void
-DRI2DestroyDrawable(Display *dpy, XID drawable)
+static Bool
+DRI2WireToEvent(Display *dpy, XEvent *event, xEvent *wire)
 {
-
   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
-  xDRI2DestroyDrawableReq *req;
 
-  XextSimpleCheckExtension(dpy, info, dri2ExtensionName);
+  XextCheckExtension(dpy, info, dri2ExtensionName, False);
+
+  switch ((wire->u.u.type & 0x7f) - info->codes->first_event)
+  {
+    case DRI2_InvalidateBuffers:
+    {
+      xDRI2InvalidateBuffers *awire = (xDRI2InvalidateBuffers *)wire;
+
+      dri2InvalidateBuffers(dpy, awire->drawable);
+      break;
+    }
+    case DRI2_BufferSwapComplete:
+    {
+      xDRI2BufferSwapComplete2 *awire = (xDRI2BufferSwapComplete2 *)wire;
+
+      dri2SwapComplete(dpy, awire->drawable, awire->sbc);
+      break;
+    }
+    default:
+      break;
+  }
+
+  /* Nothing is ever queued for the application */
+  return False;
+}
+
+/*
+ * Requests go straight to the XCB connection underneath Xlib, so waiting for
+ * a reply doesn't hold the display lock and replies can be collected later.
+ * The major opcode is taken from the Xlib extension info, passing it as a
+ * core opcode keeps XCB from querying the extension once more. The minor
+ * opcode is already in the request.
+ */
+static unsigned int
+DRI2SendRequest(Display *dpy, XExtDisplayInfo *info, void *req, size_t len,
+                const void *extra, size_t extra_len, Bool isvoid)
+{
+   xcb_protocol_request_t xcb_req;
+   struct iovec parts[4];
+
+   xcb_req.count = extra_len ? 2 : 1;
+   xcb_req.ext = NULL;
+   xcb_req.opcode = info->codes->major_opcode;
+   xcb_req.isvoid = isvoid;
+
+   parts[2].iov_base = req;
+   parts[2].iov_len = len;
+   parts[3].iov_base = (void *) extra;
+   parts[3].iov_len = extra_len;
+
+   return xcb_send_request(XGetXCBConnection(dpy), 0, parts + 2, &xcb_req);
+}
+
+/* Errors are returned with the reply instead of going to the error handler */
+static void *
+DRI2WaitReply(Display *dpy, unsigned int cookie)
+{
+   xcb_generic_error_t *error = NULL;
+   void *reply;
 
-  XSync(dpy, False);
+   if (!cookie)
+      return NULL;
 
-  LockDisplay(dpy);
-  GetReq(DRI2DestroyDrawable, req);
-  req->reqType = info->codes->major_opcode;
-  req->dri2ReqType = X_DRI2DestroyDrawable;
-  req->drawable = drawable;
-  UnlockDisplay(dpy);
+   reply = xcb_wait_for_reply(XGetXCBConnection(dpy), cookie, &error);
 
-  SyncHandle();
+   if (error) {
+      free(error);
+      free(reply);
+      return NULL;
+   }
+
+   return reply;
+}
+
+void
+DRI2DiscardReply(Display *dpy, unsigned int cookie)
+{
+   if (cookie)
+      xcb_discard_reply(XGetXCBConnection(dpy), cookie);
+}
+
+void
+DRI2DestroyDrawable(Display *dpy, XID drawable)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2DestroyDrawableReq req;
+
+   XextSimpleCheckExtension(dpy, info, dri2ExtensionName);
+
+   /* Not flushed, goes out with the next batch of requests */
+   req.dri2ReqType = X_DRI2DestroyDrawable;
+   req.drawable = drawable;
+   DRI2SendRequest(dpy, info, &req, sz_xDRI2DestroyDrawableReq, NULL, 0, True);
 }
 
 Bool
@@ -90,122 +175,287 @@ DRI2CopyRegion(Display * dpy, XID drawable, XserverRegion region,
                CARD32 dest, CARD32 src)
 {
    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
-   xDRI2CopyRegionReq *req;
-   xDRI2CopyRegionReply rep;
+   xDRI2CopyRegionReq req;
 
    XextSimpleCheckExtension(dpy, info, dri2ExtensionName);
 
-   LockDisplay(dpy);
-   GetReq(DRI2CopyRegion, req);
-   req->reqType = info->codes->major_opcode;
-   req->dri2ReqType = X_DRI2CopyRegion;
-   req->drawable = drawable;
-   req->region = region;
-   req->dest = dest;
-   req->src = src;
-
-   _XReply(dpy, (xReply *) & rep, 0, xFalse);
+   req.dri2ReqType = X_DRI2CopyRegion;
+   req.drawable = drawable;
+   req.region = region;
+   req.dest = dest;
+   req.src = src;
 
-   UnlockDisplay(dpy);
-   SyncHandle();
+   free(DRI2WaitReply(dpy, DRI2SendRequest(dpy, info, &req,
+                                           sz_xDRI2CopyRegionReq, NULL, 0,
+                                           False)));
 }
 
 void
 DRI2CreateDrawable(Display * dpy, XID drawable)
 {
    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
-   xDRI2CreateDrawableReq *req;
+   xDRI2CreateDrawableReq req;
 
    XextSimpleCheckExtension(dpy, info, dri2ExtensionName);
 
-   LockDisplay(dpy);
-   GetReq(DRI2CreateDrawable, req);
-   req->reqType = info->codes->major_opcode;
-   req->dri2ReqType = X_DRI2CreateDrawable;
-   req->drawable = drawable;
-   UnlockDisplay(dpy);
-   SyncHandle();
+   req.dri2ReqType = X_DRI2CreateDrawable;
+   req.drawable = drawable;
+   DRI2SendRequest(dpy, info, &req, sz_xDRI2CreateDrawableReq, NULL, 0, True);
+}
+
+unsigned int
+DRI2QueryVersionRequest(Display * dpy)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2QueryVersionReq req;
+
+   XextCheckExtension(dpy, info, dri2ExtensionName, 0);
+
+   req.dri2ReqType = X_DRI2QueryVersion;
+   req.majorVersion = DRI2_MAJOR;
+   req.minorVersion = DRI2_MINOR;
+
+   return DRI2SendRequest(dpy, info, &req, sz_xDRI2QueryVersionReq, NULL, 0,
+                          False);
+}
+
+Bool
+DRI2QueryVersionReply(Display * dpy, unsigned int cookie, int *major,
+                      int *minor)
+{
+   xDRI2QueryVersionReply *rep = DRI2WaitReply(dpy, cookie);
+
+   if (!rep)
+      return False;
+
+   *major = rep->majorVersion;
+   *minor = rep->minorVersion;
+   free(rep);
+
+   return True;
 }
 
 Bool
 DRI2QueryVersion(Display * dpy, int *major, int *minor)
+{
+   return DRI2QueryVersionReply(dpy, DRI2QueryVersionRequest(dpy), major,
+                                minor);
+}
+
+/* Both requests share the layout, WithFormat has two words per attachment */
+static unsigned int
+DRI2SendGetBuffers(Display * dpy, XID drawable, CARD8 dri2ReqType,
+                   unsigned int *attachments, int count, int words)
 {
    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
-   xDRI2QueryVersionReply rep;
-   xDRI2QueryVersionReq *req;
+   xDRI2GetBuffersReq req;
+   CARD32 p[count * words];
+   int i;
 
-   XextCheckExtension(dpy, info, dri2ExtensionName, False);
+   XextCheckExtension(dpy, info, dri2ExtensionName, 0);
 
-   LockDisplay(dpy);
-   GetReq(DRI2QueryVersion, req);
-   req->reqType = info->codes->major_opcode;
-   req->dri2ReqType = X_DRI2QueryVersion;
-   req->majorVersion = DRI2_MAJOR;
-   req->minorVersion = DRI2_MINOR;
+   req.dri2ReqType = dri2ReqType;
+   req.drawable = drawable;
+   req.count = count;
 
-   if (!_XReply(dpy, (xReply *) & rep, 0, xFalse)) {
-      UnlockDisplay(dpy);
-      SyncHandle();
-      return False;
+   for (i = 0; i < count * words; i++)
+      p[i] = attachments[i];
+
+   return DRI2SendRequest(dpy, info, &req, sz_xDRI2GetBuffersReq, p,
+                          count * words * 4, False);
+}
+
+unsigned int
+DRI2GetBuffersRequest(Display * dpy, XID drawable, unsigned int *attachments,
+                      int count)
+{
+   return DRI2SendGetBuffers(dpy, drawable, X_DRI2GetBuffers, attachments,
+                             count, 1);
+}
+
+unsigned int
+DRI2GetBuffersWithFormatRequest(Display * dpy, XID drawable,
+                                unsigned int *attachments, int count)
+{
+   return DRI2SendGetBuffers(dpy, drawable, X_DRI2GetBuffersWithFormat,
+                             attachments, count, 2);
+}
+
+DRI2Buffer *
+DRI2GetBuffersReply(Display * dpy, unsigned int cookie, int *width,
+                    int *height, int *outCount)
+{
+   xDRI2GetBuffersReply *rep = DRI2WaitReply(dpy, cookie);
+   xDRI2Buffer *repBuffers;
+   DRI2Buffer *buffers;
+   int i;
+
+   if (!rep)
+      return NULL;
+
+   *width = rep->width;
+   *height = rep->height;
+   *outCount = rep->count;
+
+   repBuffers = (xDRI2Buffer *) ((char *) rep + sz_xDRI2GetBuffersReply);
+   buffers = calloc(rep->count, sizeof buffers[0]);
+
+   for (i = 0; buffers && i < rep->count; i++) {
+      buffers[i].attachment = repBuffers[i].attachment;
+      buffers[i].name = repBuffers[i].name;
+      buffers[i].pitch = repBuffers[i].pitch;
+      buffers[i].cpp = repBuffers[i].cpp;
+      buffers[i].flags = repBuffers[i].flags;
    }
 
-   *major = rep.majorVersion;
-   *minor = rep.minorVersion;
-   UnlockDisplay(dpy);
-   SyncHandle();
+   free(rep);
 
-   return True;
+   return buffers;
 }
 
 DRI2Buffer *
 DRI2GetBuffers(Display * dpy, XID drawable,
                int *width, int *height,
                unsigned int *attachments, int count, int *outCount)
+{
+   return DRI2GetBuffersReply(dpy,
+                              DRI2GetBuffersRequest(dpy, drawable,
+                                                    attachments, count),
+                              width, height, outCount);
+}
+
+unsigned int
+DRI2SwapBuffersRequest(Display * dpy, XID drawable, CARD64 target_msc,
+                       CARD64 divisor, CARD64 remainder)
 {
    XExtDisplayInfo *info = DRI2FindDisplay(dpy);
-   xDRI2GetBuffersReply rep;
-   xDRI2GetBuffersReq *req;
-   DRI2Buffer *buffers;
-   xDRI2Buffer repBuffer;
-   CARD32 *p;
-   int i;
+   xDRI2SwapBuffersReq req;
+   unsigned int cookie;
+
+   XextCheckExtension(dpy, info, dri2ExtensionName, 0);
+
+   req.dri2ReqType = X_DRI2SwapBuffers;
+   req.drawable = drawable;
+   req.target_msc_hi = target_msc >> 32;
+   req.target_msc_lo = target_msc & 0xffffffff;
+   req.divisor_hi = divisor >> 32;
+   req.divisor_lo = divisor & 0xffffffff;
+   req.remainder_hi = remainder >> 32;
+   req.remainder_lo = remainder & 0xffffffff;
+
+   cookie = DRI2SendRequest(dpy, info, &req, sz_xDRI2SwapBuffersReq, NULL, 0,
+                            False);
+
+   /* Nothing else may flush the swap out before the next frame */
+   if (cookie)
+      xcb_flush(XGetXCBConnection(dpy));
+
+   return cookie;
+}
+
+Bool
+DRI2SwapBuffersReply(Display * dpy, unsigned int cookie, CARD64 *count)
+{
+   xDRI2SwapBuffersReply *rep = DRI2WaitReply(dpy, cookie);
+
+   if (!rep)
+      return False;
+
+   *count = (CARD64)rep->swap_hi << 32 | rep->swap_lo;
+   free(rep);
+
+   return True;
+}
+
+static Bool
+DRI2MSCReply(Display * dpy, unsigned int cookie, CARD64 *ust, CARD64 *msc,
+             CARD64 *sbc)
+{
+   xDRI2MSCReply *rep = DRI2WaitReply(dpy, cookie);
+
+   if (!rep)
+      return False;
+
+   *ust = ((CARD64) rep->ust_hi << 32) | rep->ust_lo;
+   *msc = ((CARD64) rep->msc_hi << 32) | rep->msc_lo;
+   *sbc = ((CARD64) rep->sbc_hi << 32) | rep->sbc_lo;
+   free(rep);
+
+   return True;
+}
+
+Bool
+DRI2GetMSC(Display * dpy, XID drawable, CARD64 *ust, CARD64 *msc,
+           CARD64 *sbc)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2GetMSCReq req;
 
    XextCheckExtension(dpy, info, dri2ExtensionName, False);
 
-   LockDisplay(dpy);
-   GetReqExtra(DRI2GetBuffers, count * 4, req);
-   req->reqType = info->codes->major_opcode;
-   req->dri2ReqType = X_DRI2GetBuffers;
-   req->drawable = drawable;
-   req->count = count;
-   p = (CARD32 *) & req[1];
-   for (i = 0; i < count; i++)
-      p[i] = attachments[i];
+   req.dri2ReqType = X_DRI2GetMSC;
+   req.drawable = drawable;
 
-   if (!_XReply(dpy, (xReply *) & rep, 0, xFalse)) {
-      UnlockDisplay(dpy);
-      SyncHandle();
-      return NULL;
-   }
+   return DRI2MSCReply(dpy, DRI2SendRequest(dpy, info, &req,
+                                            sz_xDRI2GetMSCReq, NULL, 0,
+                                            False),
+                       ust, msc, sbc);
+}
 
-   *width = rep.width;
-   *height = rep.height;
-   *outCount = rep.count;
-
-   buffers = calloc(rep.count, sizeof buffers[0]);
-   for (i = 0; i < rep.count; i++) {
-      _XReadPad(dpy, (char *) &repBuffer, sizeof repBuffer);
-      if (buffers) {
-         buffers[i].attachment = repBuffer.attachment;
-         buffers[i].name = repBuffer.name;
-         buffers[i].pitch = repBuffer.pitch;
-         buffers[i].cpp = repBuffer.cpp;
-         buffers[i].flags = repBuffer.flags;
-      }
-   }
+Bool
+DRI2WaitMSC(Display * dpy, XID drawable, CARD64 target_msc, CARD64 divisor,
+            CARD64 remainder, CARD64 *ust, CARD64 *msc, CARD64 *sbc)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2WaitMSCReq req;
 
-   UnlockDisplay(dpy);
-   SyncHandle();
+   XextCheckExtension(dpy, info, dri2ExtensionName, False);
 
-   return buffers;
+   req.dri2ReqType = X_DRI2WaitMSC;
+   req.drawable = drawable;
+   req.target_msc_hi = target_msc >> 32;
+   req.target_msc_lo = target_msc & 0xffffffff;
+   req.divisor_hi = divisor >> 32;
+   req.divisor_lo = divisor & 0xffffffff;
+   req.remainder_hi = remainder >> 32;
+   req.remainder_lo = remainder & 0xffffffff;
+
+   return DRI2MSCReply(dpy, DRI2SendRequest(dpy, info, &req,
+                                            sz_xDRI2WaitMSCReq, NULL, 0,
+                                            False),
+                       ust, msc, sbc);
+}
+
+Bool
+DRI2WaitSBC(Display * dpy, XID drawable, CARD64 target_sbc, CARD64 *ust,
+            CARD64 *msc, CARD64 *sbc)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2WaitSBCReq req;
+
+   XextCheckExtension(dpy, info, dri2ExtensionName, False);
+
+   req.dri2ReqType = X_DRI2WaitSBC;
+   req.drawable = drawable;
+   req.target_sbc_hi = target_sbc >> 32;
+   req.target_sbc_lo = target_sbc & 0xffffffff;
+
+   return DRI2MSCReply(dpy, DRI2SendRequest(dpy, info, &req,
+                                            sz_xDRI2WaitSBCReq, NULL, 0,
+                                            False),
+                       ust, msc, sbc);
+}
+
+void
+DRI2SwapInterval(Display * dpy, XID drawable, int interval)
+{
+   XExtDisplayInfo *info = DRI2FindDisplay(dpy);
+   xDRI2SwapIntervalReq req;
+
+   XextSimpleCheckExtension(dpy, info, dri2ExtensionName);
+
+   req.dri2ReqType = X_DRI2SwapInterval;
+   req.drawable = drawable;
+   req.interval = interval;
+   DRI2SendRequest(dpy, info, &req, sz_xDRI2SwapIntervalReq, NULL, 0, True);
 }
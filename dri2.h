@@ -16,4 +16,29 @@ void DRI2CreateDrawable(Display * dpy, XID drawable);
 Bool DRI2QueryExtension(Display * dpy, int *eventBase, int *errorBase);
 Bool DRI2QueryVersion(Display * dpy, int *major, int *minor);
 DRI2Buffer *DRI2GetBuffers(Display * dpy, XID drawable, int *width, int *height, unsigned int *attachments, int count, int *outCount);
+
+/*
+ * Split versions of the above, the request returns a cookie, 0 on failure,
+ * that has to be passed to the reply function or to DRI2DiscardReply.
+ */
+unsigned int DRI2QueryVersionRequest(Display * dpy);
+Bool DRI2QueryVersionReply(Display * dpy, unsigned int cookie, int *major, int *minor);
+unsigned int DRI2GetBuffersRequest(Display * dpy, XID drawable, unsigned int *attachments, int count);
+/* DRI2 1.1, attachments holds count pairs of attachment and bits per pixel */
+unsigned int DRI2GetBuffersWithFormatRequest(Display * dpy, XID drawable, unsigned int *attachments, int count);
+DRI2Buffer *DRI2GetBuffersReply(Display * dpy, unsigned int cookie, int *width, int *height, int *outCount);
+/* The request is flushed right away, the reply returns the swap count */
+unsigned int DRI2SwapBuffersRequest(Display * dpy, XID drawable, CARD64 target_msc, CARD64 divisor, CARD64 remainder);
+Bool DRI2SwapBuffersReply(Display * dpy, unsigned int cookie, CARD64 *count);
+void DRI2DiscardReply(Display * dpy, unsigned int cookie);
+
+Bool DRI2GetMSC(Display * dpy, XID drawable, CARD64 *ust, CARD64 *msc, CARD64 *sbc);
+Bool DRI2WaitMSC(Display * dpy, XID drawable, CARD64 target_msc, CARD64 divisor, CARD64 remainder, CARD64 *ust, CARD64 *msc, CARD64 *sbc);
+Bool DRI2WaitSBC(Display * dpy, XID drawable, CARD64 target_sbc, CARD64 *ust, CARD64 *msc, CARD64 *sbc);
+void DRI2SwapInterval(Display * dpy, XID drawable, int interval);
+
+/* Called from the event hook when the server invalidates drawable's buffers */
+extern void dri2InvalidateBuffers(Display *dpy, XID drawable);
+/* Called from the event hook when a SwapBuffers request has completed */
+extern void dri2SwapComplete(Display *dpy, XID drawable, CARD64 sbc);
 #endif
@@ -2,19 +2,27 @@
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrandr.h>
 #include <X11/extensions/dri2proto.h>
 
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/shm.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "services.h"
 #include "pvr2d.h"
 #include "dri2.h"
+#include "wsegldri2.h"
+#include "convert.h"
 
 typedef Window NativeWindowType;
 typedef Display * NativeDisplayType;
@@ -29,345 +37,2068 @@ typedef Drawable NativePixmapType;
 
 #include "wsegl.h"
 
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct _wsegldri2_drawable wsegldri2_drawable;
+
+/* A server shm buffer, attached and wrapped for the GPU */
+typedef struct _wsegldri2_shm wsegldri2_shm;
+struct _wsegldri2_shm
+{
+  wsegldri2_shm *prev;
+  wsegldri2_shm *next;
+  int name;
+  void *shmaddr;
+  unsigned long size;
+  PVR2DMEMINFO *pvr_meminfo;
+  unsigned int ref_cnt;
+  ShmSeg shmseg;
+};
+
+/*
+ * A shm segment of our own, shared with the server and wrapped for the GPU
+ * the first time the GPU copies into it, kept in a pool of power of two page
+ * counts for the next copy.
+ */
+#define STAGING_CLASSES 13
+
+typedef struct _wsegldri2_staging wsegldri2_staging;
+struct _wsegldri2_staging
+{
+  wsegldri2_staging *next;
+  XShmSegmentInfo info;
+  unsigned long size;
+  PVR2DMEMINFO *pvr_meminfo;
+  Bool wrap_failed;
+};
+
 typedef struct _wsegldri2_display wsegldri2_display;
 struct _wsegldri2_display
 {
+  wsegldri2_display *next;
   unsigned long ref_cnt;
+  /* Protects the shm cache, the staging buffers and the GCs */
+  pthread_mutex_t lock;
+  /* Protects the drawables list, never held across Xlib calls */
+  pthread_mutex_t drawables_lock;
+  /* Mappings waiting for the GPU before they can be freed */
+  pthread_mutex_t reaper_lock;
+  pthread_cond_t reaper_cond;
+  pthread_t reaper;
+  Bool reaper_running;
+  Bool reaper_exit;
+  wsegldri2_shm *reap_list;
+  NativeDisplayType native_dpy;
   Display *dpy;
   Bool default_dpy;
   PVR2DCONTEXTHANDLE pvr_context;
   WSEGLConfig *configs;
+  wsegldri2_drawable *drawables;
+  int dri2_minor;
+  unsigned int frames_in_flight;
+  WSEGLCaps caps[5];
+  wsegldri2_shm *shm_cache;
+  /* Idle server mappings and pooled staging buffers together */
+  unsigned long shm_cache_budget;
+  Bool has_shm;
+  Bool has_randr;
+  /* Default number of back buffers of a window */
+  unsigned int back_buffers;
+  PVR2DDISPLAYINFO fb_info;
+  /* Buffers in a flip chain, 0 if fullscreen windows can't flip */
+  unsigned long flip_buffers;
+  wsegldri2_staging *staging_pool[STAGING_CLASSES];
+  unsigned long staging_pooled;
+  char *image_buf;
+  unsigned long image_buf_size;
+  struct
+  {
+    unsigned int depth;
+    GC gc;
+  } gcs[4];
 };
 
-typedef struct _wsegldri2_drawable wsegldri2_drawable;
 struct _wsegldri2_drawable
 {
+  wsegldri2_drawable *next;
+  pthread_mutex_t lock;
   int drawable_type;
   NativePixmapType nativePixmap;
   PVR2DMEMINFO *pvr_meminfo;
+  wsegldri2_shm *shm;
   int name;
-  void *shmaddr;
-  int is_pixmap;
+  Bool buffers_valid;
+  unsigned int buffers_serial;
+  /* GetBuffers sent on creation, and the invalidate serial at that time */
+  unsigned int buffers_cookie;
+  unsigned int cookie_serial;
+  /* Last SwapBuffers, its reply comes after the invalidate events it caused */
+  unsigned int swap_cookie;
+  volatile unsigned int invalidate_serial;
   unsigned int width;
   unsigned int height;
   int pixel_format;
   int stride;
   wsegldri2_display *display;
+  /* Damage for the next swap, protected by the drawables lock */
+  XRectangle *damage;
+  int num_damage;
+  Bool sbc_valid;
+  CARD64 swap_sbc;
+  CARD64 complete_sbc;
+  volatile unsigned int event_sbc;
+  unsigned long swap_interval;
+  CARD64 last_msc;
+  /* Frame each buffer was last presented as, for the age of the back one */
+  struct
+  {
+    int key;
+    CARD64 frame;
+  } presented[4];
+  CARD64 frames;
+  volatile int buffer_age;
+  /* Back buffers asked for, set from any thread */
+  volatile unsigned int back_buffers;
+  /* Asked for by WSEGL_SetBackBufferCount rather than the app hint */
+  volatile Bool back_buffers_set;
+  /* The GPU renders rotated, set only if the window flipped when created */
+  WSEGLRotationAngle rotation;
+  /* Rendered into instead while not flipping, turned back on every swap */
+  PVR2DMEMINFO *rotated;
+  int rotated_stride;
+  /* What it is turned back into, the server's buffer or the framebuffer */
+  PVR2DMEMINFO *unrotated;
+  long unrotated_pitch;
+  /* Flip chain rendered into instead of the framebuffer, when fullscreen */
+  PVR2DFLIPCHAINHANDLE flip_chain;
+  PVR2DMEMINFO *flip_buffers[3];
+  unsigned long num_flip_buffers;
+  unsigned long flip_length;
+  unsigned long flip_back;
+  long flip_stride;
+  Bool flip_presented;
 };
 
 
-static wsegldri2_display wsegl_display;
-static int bpp[] = {2, 2, 4};
-static WSEGLCaps caps_hw_sync[] =
+/* Protects the displays list, never held across Xlib calls */
+static pthread_mutex_t display_lock = PTHREAD_MUTEX_INITIALIZER;
+static wsegldri2_display *displays;
+/* Display the calling thread last created a drawable on, may be stale */
+static __thread wsegldri2_display *thread_display;
+static int bpp[] = {2, 2, 4, 2};
+static const PVR2DFORMAT pvr2d_format[] =
 {
-  {WSEGL_CAP_WINDOWS_USE_HW_SYNC, 1},
-  {WSEGL_NO_CAPS, 0}
+  PVR2D_RGB565, PVR2D_ARGB4444, PVR2D_ARGB8888, PVR2D_ARGB1555
 };
+static const unsigned long max_swap_interval = 10;
 
-static WSEGLCaps caps_no_hw_sync[] =
+/* Latency histograms have a bucket per power of 2 nanoseconds */
+typedef struct
 {
-  {WSEGL_NO_CAPS, 0}
-};
+  unsigned long long calls;
+  unsigned long long max_ns;
+  unsigned long long histogram[64];
+} wsegldri2_fn_stats;
 
-static WSEGLError
-WSEGLDRI2IsDisplayValid(NativeDisplayType nativeDisplay)
+static struct
 {
-  Display *dpy = nativeDisplay;
-  WSEGLError rv;
-  LOG();
-  if (!nativeDisplay)
-  {
-    nativeDisplay = XOpenDisplay(0);
+  wsegldri2_fn_stats functions[WSEGLDRI2_STAT_NUM_FUNCTIONS];
+  unsigned long long round_trips;
+  unsigned long long mem_wraps;
+  unsigned long long shm_attaches;
+  unsigned long long bytes_copied;
+  unsigned long long allocations;
+  FILE *dump_file;
+  unsigned long long dump_period_ns;
+  unsigned long long last_dump_ns;
+} wsegl_stats;
+
+static const char *const stat_names[WSEGLDRI2_STAT_NUM_FUNCTIONS] =
+{
+  "IsDisplayValid",
+  "InitialiseDisplay",
+  "CloseDisplay",
+  "CreateWindowDrawable",
+  "CreatePixmapDrawable",
+  "DeleteDrawable",
+  "SwapDrawable",
+  "SwapControlInterval",
+  "WaitNative",
+  "CopyFromDrawable",
+  "CopyFromPBuffer",
+  "GetDrawableParameters"
+};
 
-    if (!nativeDisplay)
-      return WSEGL_BAD_NATIVE_DISPLAY;
-  }
+#define STAT_ADD(counter, n) \
+  __sync_fetch_and_add(&wsegl_stats.counter, (unsigned long long)(n))
 
-  if (*DisplayString(nativeDisplay) == ':')
-    rv = WSEGL_SUCCESS;
-  else
-    rv = WSEGL_BAD_NATIVE_DISPLAY;
+static unsigned long long
+WSEGLDRI2StatTime(void)
+{
+  struct timespec ts;
 
-  if (!dpy)
-    XCloseDisplay(nativeDisplay);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-  return rv;
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static WSEGLError
-WSEGLDRI2InitialiseDisplay(NativeDisplayType dpy, WSEGLDisplayHandle* handle,
-                           const WSEGLCaps **caps, WSEGLConfig **configs)
+/* Upper bound of the bucket the percentile falls in */
+static unsigned long long
+WSEGLDRI2StatPercentile(const unsigned long long *histogram,
+                        unsigned long long calls, unsigned int percent)
 {
-  wsegldri2_display **display = (wsegldri2_display **)handle;
-  WSEGLCaps *wsegldri2_caps;
-  WSEGLError rv;
-  int num_devs;
-  PVR2DDEVICEINFO *dev_info;
-  PVR2DDISPLAYINFO pDisplayInfo;
-  unsigned int dev_id;
+  unsigned long long target = (calls * percent + 99) / 100;
+  unsigned long long sum = 0;
   int i;
-  XVisualInfo *visuals;
-  int minor;
-  int major;
-  int errorBase;
-  int eventBase;
-  void *state;
-  int use_hw_sync;
-  unsigned int pvDefault = 1;
-  int num_visuals;
-  LOG();
-
-  PVRSRVCreateAppHintState(IMG_EGL, 0, &state);
-  PVRSRVGetAppHint(state, "WSEGL_UseHWSync", IMG_UINT_TYPE, &pvDefault,
-                   &use_hw_sync);
-  PVRSRVFreeAppHintState(IMG_EGL, state);
-
-  if (use_hw_sync)
-    wsegldri2_caps = caps_hw_sync;
-  else
-    wsegldri2_caps = caps_no_hw_sync;
-
-  wsegl_display.ref_cnt++;
 
-  if (wsegl_display.ref_cnt != 1 && wsegl_display.ref_cnt < ULONG_MAX)
+  for (i = 0; i < 64; i++)
   {
-    *display = &wsegl_display;
-    *caps = wsegldri2_caps;
-    *configs = wsegl_display.configs;
-    return WSEGL_SUCCESS;
+    sum += histogram[i];
+
+    if (sum >= target)
+      return i ? (1ULL << i) - 1 : 0;
   }
 
-  rv = WSEGL_CANNOT_INITIALISE;
+  return ~0ULL;
+}
 
-  if (!dpy)
+void
+WSEGL_GetStatistics(WSEGLDRI2Statistics *stats)
+{
+  unsigned long long histogram[64];
+  int i;
+  int j;
+
+  for (i = 0; i < WSEGLDRI2_STAT_NUM_FUNCTIONS; i++)
   {
-    dpy = XOpenDisplay(WSEGL_DEFAULT_DISPLAY);
+    wsegldri2_fn_stats *fn = &wsegl_stats.functions[i];
+    WSEGLDRI2FunctionStatistics *out = &stats->functions[i];
 
-    if (!dpy)
-      return rv;
+    out->calls = 0;
+
+    /* Histograms are updated concurrently, take the total from a snapshot */
+    for (j = 0; j < 64; j++)
+    {
+      histogram[j] = fn->histogram[j];
+      out->calls += histogram[j];
+    }
 
-    wsegl_display.default_dpy = WSEGL_TRUE;
+    out->p50_ns = WSEGLDRI2StatPercentile(histogram, out->calls, 50);
+    out->p99_ns = WSEGLDRI2StatPercentile(histogram, out->calls, 99);
+    out->max_ns = fn->max_ns;
   }
-  else
-    wsegl_display.default_dpy = WSEGL_FALSE;
 
-  num_devs = PVR2DEnumerateDevices(NULL);
+  stats->round_trips = wsegl_stats.round_trips;
+  stats->mem_wraps = wsegl_stats.mem_wraps;
+  stats->shm_attaches = wsegl_stats.shm_attaches;
+  stats->bytes_copied = wsegl_stats.bytes_copied;
+  stats->allocations = wsegl_stats.allocations;
+}
 
-  if (num_devs <= 0)
-    goto err;
+void
+WSEGL_ResetStatistics(void)
+{
+  memset(wsegl_stats.functions, 0, sizeof(wsegl_stats.functions));
+  wsegl_stats.round_trips = 0;
+  wsegl_stats.mem_wraps = 0;
+  wsegl_stats.shm_attaches = 0;
+  wsegl_stats.bytes_copied = 0;
+  wsegl_stats.allocations = 0;
+}
 
-  dev_info = (PVR2DDEVICEINFO *)malloc(24 * num_devs);
+static void
+WSEGLDRI2DumpStatistics(FILE *file)
+{
+  WSEGLDRI2Statistics stats;
+  unsigned long long frames;
+  int i;
 
-  if (!dev_info)
-  {
-    rv = WSEGL_OUT_OF_MEMORY;
-    goto err;
-  }
+  WSEGL_GetStatistics(&stats);
+  frames = stats.functions[WSEGLDRI2_STAT_SWAP_DRAWABLE].calls;
 
-  if (PVR2DEnumerateDevices(dev_info))
+  for (i = 0; i < WSEGLDRI2_STAT_NUM_FUNCTIONS; i++)
   {
-    free(dev_info);
-    goto err;
-  }
+    WSEGLDRI2FunctionStatistics *fn = &stats.functions[i];
 
-  dev_id = dev_info->ulDevID;
-  free(dev_info);
-
-  if (PVR2DCreateDeviceContext(dev_id, &wsegl_display.pvr_context, 0))
-    goto err;
+    if (!fn->calls)
+      continue;
 
-  wsegl_display.dpy = dpy;
+    fprintf(file, "%s: calls %llu p50 %lluns p99 %lluns max %lluns\n",
+            stat_names[i], fn->calls, fn->p50_ns, fn->p99_ns, fn->max_ns);
+  }
 
-  if (PVR2DGetDeviceInfo(wsegl_display.pvr_context, &pDisplayInfo))
-    goto err;
+  fprintf(file, "round trips %llu, mem wraps %llu, shm attaches %llu, "
+          "bytes copied %llu, allocations %llu\n", stats.round_trips,
+          stats.mem_wraps, stats.shm_attaches, stats.bytes_copied,
+          stats.allocations);
 
-  if(!DRI2QueryExtension(dpy, &eventBase, &errorBase))
-    goto context_err;
+  if (frames)
+  {
+    fprintf(file, "per frame: round trips %.2f, allocations %.2f\n",
+            (double)stats.round_trips / frames,
+            (double)stats.allocations / frames);
+  }
 
-  if(!DRI2QueryVersion(wsegl_display.dpy, &major, &minor))
-    goto context_err;
+  fputc('\n', file);
+  fflush(file);
+}
 
-  if (major != WSEGL_VERSION || minor != 0)
-    goto context_err;
+static void
+WSEGLDRI2StatCall(int function, unsigned long long start)
+{
+  wsegldri2_fn_stats *fn = &wsegl_stats.functions[function];
+  unsigned long long now = WSEGLDRI2StatTime();
+  unsigned long long ns = now - start;
+  unsigned long long max;
+  unsigned long long last_dump;
 
-  visuals = XGetVisualInfo(dpy, 0, 0, &num_visuals);
+  __sync_fetch_and_add(&fn->histogram[ns ? 64 - __builtin_clzll(ns) : 0], 1);
+  __sync_fetch_and_add(&fn->calls, 1);
 
-  if (!visuals)
+  while ((max = fn->max_ns) < ns)
   {
-    rv = WSEGL_BAD_NATIVE_DISPLAY;
-    fputs("XGetVisualInfo() returned NULL!\n", stderr);
-    goto context_err;
+    if (__sync_bool_compare_and_swap(&fn->max_ns, max, ns))
+      break;
   }
 
-  wsegl_display.configs =
-      (WSEGLConfig *)calloc(num_visuals + 1, sizeof(WSEGLConfig));
+  if (!wsegl_stats.dump_file)
+    return;
+
+  /* Whoever moves last_dump_ns forward writes the dump */
+  last_dump = wsegl_stats.last_dump_ns;
 
-  if (!wsegl_display.configs)
+  if (now - last_dump >= wsegl_stats.dump_period_ns &&
+      __sync_bool_compare_and_swap(&wsegl_stats.last_dump_ns, last_dump, now))
   {
-    XFree(visuals);
-    rv = WSEGL_OUT_OF_MEMORY;
-    goto context_err;
+    WSEGLDRI2DumpStatistics(wsegl_stats.dump_file);
   }
+}
 
-  for (i = 0; i < num_visuals; i++)
-  {
-    WSEGLConfig *config = &wsegl_display.configs[i];
-    XVisualInfo *visual = &visuals[i];
+static void
+WSEGLDRI2OpenStatisticsFile(const char *path, unsigned int period)
+{
+  FILE *file;
 
-    switch (visual->depth)
-    {
-      case 24:
-      case 32:
-          config->ePixelFormat = WSEGL_PIXELFORMAT_8888;
-          break;
-      case 16:
-        config->ePixelFormat = WSEGL_PIXELFORMAT_565;
-        break;
-      default:
-        continue;
-    }
+  if (!*path || wsegl_stats.dump_file)
+    return;
 
-    config->ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
-    config->ulNativeRenderable = WSEGL_TRUE;
-    config->ulNativeVisualID = visual->visualid;
-  }
+  file = fopen(path, "a");
 
-  XFree(visuals);
-  wsegl_display.ref_cnt = 1;
-  *caps = wsegldri2_caps;
-  *configs = wsegl_display.configs;
-  *display = &wsegl_display;
+  if (!file)
+    return;
 
-  return WSEGL_SUCCESS;
+  wsegl_stats.dump_period_ns = period * 1000000000ULL;
+  wsegl_stats.last_dump_ns = WSEGLDRI2StatTime();
 
-context_err:
-  PVR2DDestroyDeviceContext(wsegl_display.pvr_context);
+  if (!__sync_bool_compare_and_swap(&wsegl_stats.dump_file, NULL, file))
+    fclose(file);
+}
 
-err:
-  if (wsegl_display.default_dpy == WSEGL_TRUE)
-    XCloseDisplay(dpy);
+/* A complete span of the trace timeline, name is set last */
+typedef struct
+{
+  const char *volatile name;
+  unsigned long long start_ns;
+  unsigned long long duration_ns;
+  XID xid;
+  int buffer;
+  pid_t tid;
+} wsegldri2_trace_event;
+
+/* Only allocated when the WSEGL_TraceEvents app hint is set */
+static wsegldri2_trace_event *trace_events;
+static unsigned long trace_size;
+static unsigned long trace_head;
+static char trace_file[PATH_MAX];
+
+#define TRACE_BEGIN(start) \
+  ((start) = trace_events ? WSEGLDRI2StatTime() : 0)
+
+#define TRACE_END(name, start, xid, buffer) \
+  do \
+  { \
+    if (trace_events) \
+      WSEGLDRI2TraceSpan(name, start, xid, buffer); \
+  } while (0)
 
-  return rv;
+static void
+WSEGLDRI2TraceSpan(const char *name, unsigned long long start, XID xid,
+                   int buffer)
+{
+  unsigned long index = __sync_fetch_and_add(&trace_head, 1);
+  wsegldri2_trace_event *event = &trace_events[index % trace_size];
+
+  /* Oldest events get overwritten */
+  event->name = NULL;
+  __sync_synchronize();
+  event->start_ns = start;
+  event->duration_ns = WSEGLDRI2StatTime() - start;
+  event->xid = xid;
+  event->buffer = buffer;
+  event->tid = syscall(SYS_gettid);
+  __sync_synchronize();
+  event->name = name;
 }
 
-static WSEGLError
-WSEGLDRI2CloseDisplay(WSEGLDisplayHandle handle)
+Bool
+WSEGL_WriteTrace(const char *path)
 {
-  wsegldri2_display *wsegl_dpy = (wsegldri2_display *)handle;
-  LOG();
+  unsigned long head = trace_head;
+  unsigned long i;
+  const char *sep = "";
+  FILE *file;
+  pid_t pid = getpid();
 
-  if (wsegl_dpy->ref_cnt-- == 1)
-  {
-    PVR2DDestroyDeviceContext(wsegl_dpy->pvr_context);
-
-    if (wsegl_dpy->default_dpy)
-      XCloseDisplay(wsegl_dpy->dpy);
+  if (!trace_events)
+    return False;
 
-    free(wsegl_display.configs);
-  }
+  if (!path)
+    path = trace_file;
 
-  return WSEGL_SUCCESS;
-}
+  file = fopen(path, "w");
 
-static WSEGLError
-WSEGLDRI2GetDrawableInfo(wsegldri2_display *display, WSEGLConfig *config,
-                         WSEGLDrawableHandle *drawable,
-                         NativePixmapType nativePixmap,
-                         WSEGLRotationAngle *rotationAngle, int drawable_type)
-{
-  WSEGLError rv;
-  wsegldri2_drawable *handle;
-  Window window;
-  int tmp;
-  unsigned int depth;
-  unsigned int border_width;
-  Status status;
+  if (!file)
+    return False;
 
-  LOG();
+  fputs("{\"traceEvents\":[", file);
 
-  if (!nativePixmap)
+  for (i = head > trace_size ? head - trace_size : 0; i < head; i++)
   {
-    if (drawable_type == WSEGL_DRAWABLE_WINDOW)
-      return WSEGL_BAD_NATIVE_WINDOW;
-    else
-      return WSEGL_BAD_NATIVE_PIXMAP;
+    wsegldri2_trace_event *event = &trace_events[i % trace_size];
+    const char *name = event->name;
+
+    if (!name)
+      continue;
+
+    fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"wsegl\",\"ph\":\"X\","
+            "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"drawable\":\"0x%lx\",\"buffer\":%d}}", sep, name,
+            event->start_ns / 1000, event->start_ns % 1000,
+            event->duration_ns / 1000, event->duration_ns % 1000, (int)pid,
+            (int)event->tid, (unsigned long)event->xid, event->buffer);
+    sep = ",";
   }
 
-  if (!config || !(drawable_type & config->ui32DrawableType) )
-    return WSEGL_BAD_CONFIG;
+  fputs("\n]}\n", file);
 
-  handle = (wsegldri2_drawable *)calloc(1, sizeof(*handle));
+  return !fclose(file);
+}
 
-  if (!handle)
-    return WSEGL_OUT_OF_MEMORY;
+static void
+WSEGLDRI2OpenTrace(const char *path, unsigned int size)
+{
+  wsegldri2_trace_event *events;
 
-  handle->drawable_type = drawable_type;
-  handle->display = display;
-  handle->nativePixmap = nativePixmap;
+  if (!size || trace_events)
+    return;
 
-  if ((status =
-       XGetGeometry(display->dpy, nativePixmap, &window, &tmp, &tmp,
-                    &handle->width, &handle->height, &border_width, &depth)))
-  {
-    Bool is_supported;
+  events = (wsegldri2_trace_event *)calloc(size, sizeof(*events));
 
-    if (depth == 24 || depth == 32)
-      is_supported = config->ePixelFormat == WSEGL_PIXELFORMAT_8888;
-    else
-    {
-      if (depth != 16)
-      {
-        rv = WSEGL_BAD_DRAWABLE;
-        goto err;
-      }
+  if (!events)
+    return;
 
-      is_supported = config->ePixelFormat == WSEGL_PIXELFORMAT_565;
-    }
+  snprintf(trace_file, sizeof(trace_file), "%s",
+           *path ? path : "wsegl-trace.json");
+  trace_size = size;
 
-    if (is_supported)
-    {
-      handle->pixel_format = config->ePixelFormat;
-      handle->stride = (handle->width + 0x1F) & ~0x1Fu;
-      *drawable = handle;
-      *rotationAngle = WSEGL_ROTATE_0;
+  if (!__sync_bool_compare_and_swap(&trace_events, NULL, events))
+    free(events);
+}
 
-      DRI2CreateDrawable(display->dpy, nativePixmap);
+/* Runs at exit and on dlclose, unlike atexit handlers */
+static void __attribute__((destructor))
+WSEGLDRI2FlushTrace(void)
+{
+  WSEGL_WriteTrace(NULL);
+}
 
-      return WSEGL_SUCCESS;
-    }
+/* Only opened when the WSEGL_RecordFile app hint is set */
+static FILE *record_file;
 
-    rv = WSEGL_BAD_CONFIG;
-  }
-  else
-  {
-    rv = WSEGL_BAD_DRAWABLE;
-    fprintf(stderr,
-            "WSEGLDRI2GetDrawableInfo: Failed to get X drawable geometry - status %d\n",
-            status);
-    fputs("WSEGL_CreateWindowDrawable: Bad drawable\n", stderr);
-  }
+#define RECORD_ARG(x) ((uint64_t)(uintptr_t)(x))
+#define RECORD_OUT(result, x) \
+  ((result) == WSEGL_SUCCESS ? RECORD_ARG(*(x)) : 0)
+#define RECORD_ARGS(...) __VA_ARGS__
 
-err:
+static void
+WSEGLDRI2Record(unsigned int type, unsigned long long time, const void *data,
+                unsigned int size, const void *extra, unsigned int extra_size)
+{
+  WSEGLDRI2RecordHeader header;
 
-  free(handle);
+  header.type = type;
+  header.size = size + extra_size;
+  header.time_ns = time;
+  header.tid = syscall(SYS_gettid);
+  header.reserved = 0;
 
-  return rv;
+  /* Records of different threads must not interleave */
+  flockfile(record_file);
+  fwrite(&header, sizeof(header), 1, record_file);
+  fwrite(data, size, 1, record_file);
+
+  if (extra_size)
+    fwrite(extra, extra_size, 1, record_file);
+
+  funlockfile(record_file);
 }
 
-static WSEGLError
-WSEGLDRI2CreateWindowDrawable(WSEGLDisplayHandle display, WSEGLConfig *config,
-                              WSEGLDrawableHandle *drawable,
-                              NativeWindowType nativeWindow,
-                              WSEGLRotationAngle *rotationAngle)
+static void
+WSEGLDRI2RecordFunction(int function, unsigned long long start, WSEGLError rv,
+                        const uint64_t *args, unsigned int num_args,
+                        const uint64_t *outs, unsigned int num_outs,
+                        const void *structs, unsigned int structs_size)
 {
-  LOG();
+  WSEGLDRI2RecordCall call;
+  char payload[(num_args + num_outs) * sizeof(uint64_t) + structs_size];
+
+  call.function = function;
+  call.result = rv;
+  call.duration_ns = WSEGLDRI2StatTime() - start;
+  call.num_args = num_args;
+  call.num_outs = num_outs;
+  memcpy(payload, args, num_args * sizeof(*args));
+  memcpy(payload + num_args * sizeof(*args), outs, num_outs * sizeof(*outs));
+  memcpy(payload + (num_args + num_outs) * sizeof(*args), structs,
+         structs_size);
+  WSEGLDRI2Record(WSEGLDRI2_RECORD_CALL, start, &call, sizeof(call), payload,
+                  sizeof(payload));
+
+  /* Lose at most a frame if the process dies */
+  if (function == WSEGLDRI2_STAT_SWAP_DRAWABLE)
+    fflush(record_file);
+}
 
-  return WSEGLDRI2GetDrawableInfo((wsegldri2_display *)display, config,
-                                  drawable, nativeWindow, rotationAngle,
-                                  WSEGL_DRAWABLE_WINDOW);
+static void
+WSEGLDRI2RecordFillConfig(WSEGLDRI2RecordConfig *record,
+                          const WSEGLConfig *config)
+{
+  record->drawable_type = config->ui32DrawableType;
+  record->pixel_format = config->ePixelFormat;
+  record->native_renderable = config->ulNativeRenderable;
+  record->frame_buffer_level = config->ulFrameBufferLevel;
+  record->native_visual_id = config->ulNativeVisualID;
+  record->native_visual = RECORD_ARG(config->hNativeVisual);
+  record->transparent_type = config->eTransparentType;
+  record->transparent_color = config->ulTransparentColor;
 }
 
-static WSEGLError
+static void
+WSEGLDRI2RecordFillParams(WSEGLDRI2RecordParams *record,
+                          const WSEGLDrawableParams *params)
+{
+  record->width = params->ui32Width;
+  record->height = params->ui32Height;
+  record->stride = params->ui32Stride;
+  record->pixel_format = params->ePixelFormat;
+  record->linear_address = RECORD_ARG(params->pvLinearAddress);
+  record->private_data = RECORD_ARG(params->hPrivateData);
+  record->hw_address = params->ui32HWAddress;
+  record->reserved = 0;
+}
+
+/*
+ * The structures that follow a call, see WSEGLDRI2RecordCall. Each returns
+ * their size and a buffer to free in data.
+ */
+static unsigned int
+WSEGLDRI2RecordCapsAndConfigs(WSEGLError rv, const WSEGLCaps *const *caps,
+                              WSEGLConfig *const *configs, void **data)
+{
+  WSEGLDRI2RecordCaps *record_caps;
+  WSEGLDRI2RecordConfig *record_configs;
+  unsigned int num_caps;
+  unsigned int num_configs;
+  unsigned int i;
+
+  *data = NULL;
+
+  if (rv != WSEGL_SUCCESS)
+    return 0;
+
+  for (num_caps = 1; (*caps)[num_caps - 1].eCapsType != WSEGL_NO_CAPS;
+       num_caps++)
+    ;
+
+  for (num_configs = 1; (*configs)[num_configs - 1].ui32DrawableType;
+       num_configs++)
+    ;
+
+  *data = malloc(num_caps * sizeof(*record_caps) +
+                 num_configs * sizeof(*record_configs));
+
+  if (!*data)
+    return 0;
+
+  record_caps = (WSEGLDRI2RecordCaps *)*data;
+  record_configs = (WSEGLDRI2RecordConfig *)(record_caps + num_caps);
+
+  for (i = 0; i < num_caps; i++)
+  {
+    record_caps[i].type = (*caps)[i].eCapsType;
+    record_caps[i].value = (*caps)[i].ui32CapsValue;
+  }
+
+  for (i = 0; i < num_configs; i++)
+    WSEGLDRI2RecordFillConfig(&record_configs[i], &(*configs)[i]);
+
+  return num_caps * sizeof(*record_caps) +
+         num_configs * sizeof(*record_configs);
+}
+
+static unsigned int
+WSEGLDRI2RecordConfigArg(const WSEGLConfig *config, void **data)
+{
+  *data = config ? malloc(sizeof(WSEGLDRI2RecordConfig)) : NULL;
+
+  if (!*data)
+    return 0;
+
+  WSEGLDRI2RecordFillConfig((WSEGLDRI2RecordConfig *)*data, config);
+
+  return sizeof(WSEGLDRI2RecordConfig);
+}
+
+static unsigned int
+WSEGLDRI2RecordDrawableParams(WSEGLError rv,
+                              const WSEGLDrawableParams *source,
+                              const WSEGLDrawableParams *render, void **data)
+{
+  WSEGLDRI2RecordParams *params;
+
+  *data = NULL;
+
+  if (rv != WSEGL_SUCCESS || !(params = malloc(2 * sizeof(*params))))
+    return 0;
+
+  WSEGLDRI2RecordFillParams(&params[0], source);
+  WSEGLDRI2RecordFillParams(&params[1], render);
+  *data = params;
+
+  return 2 * sizeof(*params);
+}
+
+static void
+WSEGLDRI2RecordBuffersReply(XID xid, int width, int height,
+                            const DRI2Buffer *buffers, int count,
+                            int max_count)
+{
+  WSEGLDRI2RecordBuffers reply;
+
+  reply.drawable = xid;
+  reply.width = width;
+  reply.height = height;
+  reply.count = count;
+  reply.reserved = 0;
+
+  if (!buffers || count > max_count)
+    count = buffers ? max_count : 0;
+
+  WSEGLDRI2Record(WSEGLDRI2_RECORD_BUFFERS, WSEGLDRI2StatTime(), &reply,
+                  sizeof(reply), buffers, count * sizeof(*buffers));
+}
+
+static void
+WSEGLDRI2RecordPVR2DCall(int op, PVR2DERROR result, int name,
+                         unsigned long size, PVR2DMEMINFO *meminfo)
+{
+  WSEGLDRI2RecordPVR2D call;
+
+  call.op = op;
+  call.result = result;
+  call.name = name;
+  call.size = size;
+  call.dev_addr = result == PVR2D_OK && meminfo ? meminfo->ui32DevAddr : 0;
+  call.reserved = 0;
+  WSEGLDRI2Record(WSEGLDRI2_RECORD_PVR2D, WSEGLDRI2StatTime(), &call,
+                  sizeof(call), NULL, 0);
+}
+
+/* PVR2DBlt, recorded with the bytes it writes */
+static PVR2DERROR
+WSEGLDRI2Blt(PVR2DCONTEXTHANDLE context, PVR2DBLTINFO *blt, XID xid)
+{
+  PVR2DERROR err = PVR2DBlt(context, blt);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_BLT, err, xid,
+                             blt->DSizeY * labs(blt->DstStride),
+                             blt->pDstMemInfo);
+  }
+
+  return err;
+}
+
+static void
+WSEGLDRI2OpenRecord(const char *path)
+{
+  uint32_t header[2] = { WSEGLDRI2_RECORD_MAGIC, WSEGLDRI2_RECORD_VERSION };
+  FILE *file;
+
+  if (!*path || record_file)
+    return;
+
+  file = fopen(path, "wb");
+
+  if (!file)
+    return;
+
+  fwrite(header, sizeof(header), 1, file);
+
+  if (!__sync_bool_compare_and_swap(&record_file, NULL, file))
+    fclose(file);
+}
+
+static void __attribute__((destructor))
+WSEGLDRI2CloseRecord(void)
+{
+  if (record_file)
+    fflush(record_file);
+}
+
+static void
+WSEGLDRI2ReapSharedMemory(wsegldri2_display *display, wsegldri2_shm *shm)
+{
+  PVR2DQueryBlitsComplete(display->pvr_context, shm->pvr_meminfo, PVR2D_TRUE);
+  PVR2DMemFree(display->pvr_context, shm->pvr_meminfo);
+  shmdt(shm->shmaddr);
+  free(shm);
+}
+
+/*
+ * Waits for the GPU to be done with the mappings that were dropped and frees
+ * them, in batches. Only makes PVR2D calls, Xlib may not be thread-safe.
+ */
+static void *
+WSEGLDRI2Reaper(void *data)
+{
+  wsegldri2_display *display = (wsegldri2_display *)data;
+  wsegldri2_shm *shm;
+  wsegldri2_shm *next;
+
+  pthread_mutex_lock(&display->reaper_lock);
+
+  while (display->reap_list || !display->reaper_exit)
+  {
+    if (!display->reap_list)
+    {
+      pthread_cond_wait(&display->reaper_cond, &display->reaper_lock);
+      continue;
+    }
+
+    shm = display->reap_list;
+    display->reap_list = NULL;
+    pthread_mutex_unlock(&display->reaper_lock);
+
+    for (; shm; shm = next)
+    {
+      next = shm->next;
+      WSEGLDRI2ReapSharedMemory(display, shm);
+    }
+
+    pthread_mutex_lock(&display->reaper_lock);
+  }
+
+  pthread_mutex_unlock(&display->reaper_lock);
+
+  return NULL;
+}
+
+static void
+WSEGLDRI2StopReaper(wsegldri2_display *display)
+{
+  pthread_mutex_lock(&display->reaper_lock);
+  display->reaper_exit = WSEGL_TRUE;
+  pthread_cond_signal(&display->reaper_cond);
+  pthread_mutex_unlock(&display->reaper_lock);
+
+  if (display->reaper_running)
+    pthread_join(display->reaper, NULL);
+}
+
+/* The shm must not be in the cache anymore */
+static void
+WSEGLDRI2FreeSharedMemory(wsegldri2_display *display, wsegldri2_shm *shm)
+{
+  if (shm->shmseg)
+  {
+    XShmSegmentInfo info;
+
+    info.shmseg = shm->shmseg;
+    XShmDetach(display->dpy, &info);
+  }
+
+  pthread_mutex_lock(&display->reaper_lock);
+
+  if (!display->reaper_running && !display->reaper_exit)
+  {
+    display->reaper_running =
+        !pthread_create(&display->reaper, NULL, WSEGLDRI2Reaper, display);
+  }
+
+  if (display->reaper_running && !display->reaper_exit)
+  {
+    shm->next = display->reap_list;
+    display->reap_list = shm;
+    pthread_cond_signal(&display->reaper_cond);
+    shm = NULL;
+  }
+
+  pthread_mutex_unlock(&display->reaper_lock);
+
+  /* No reaper thread, wait here */
+  if (shm)
+    WSEGLDRI2ReapSharedMemory(display, shm);
+}
+
+static void
+WSEGLDRI2UnlinkShm(wsegldri2_display *display, wsegldri2_shm *shm)
+{
+  if (shm->prev)
+    shm->prev->next = shm->next;
+  else
+    display->shm_cache = shm->next;
+
+  if (shm->next)
+    shm->next->prev = shm->prev;
+
+  shm->prev = NULL;
+  shm->next = NULL;
+}
+
+/*
+ * Drop idle mappings, least recently used first, until the idle ones fit in
+ * what the staging pool leaves of the cache budget. Mappings the server has
+ * already detached from belong to destroyed buffers and are dropped
+ * regardless of the budget.
+ */
+static void
+WSEGLDRI2TrimShmCache(wsegldri2_display *display)
+{
+  wsegldri2_shm *shm;
+  wsegldri2_shm *prev;
+  unsigned long idle = 0;
+  struct shmid_ds ds;
+
+  for (shm = display->shm_cache; shm; shm = shm->next)
+  {
+    if (!shm->ref_cnt)
+      idle += shm->size;
+
+    if (!shm->next)
+      break;
+  }
+
+  for (; shm; shm = prev)
+  {
+    prev = shm->prev;
+
+    if (shm->ref_cnt)
+      continue;
+
+    if (idle + display->staging_pooled <= display->shm_cache_budget &&
+        !shmctl(shm->name, IPC_STAT, &ds) && ds.shm_nattch > 1)
+    {
+      continue;
+    }
+
+    idle -= shm->size;
+    WSEGLDRI2UnlinkShm(display, shm);
+    WSEGLDRI2FreeSharedMemory(display, shm);
+  }
+}
+
+static wsegldri2_shm *
+WSEGLDRI2AcquireShm(wsegldri2_display *display, int name, unsigned long size)
+{
+  wsegldri2_shm *shm;
+  unsigned long flags;
+  int pagesize;
+  PVR2DERROR err;
+
+  for (shm = display->shm_cache; shm; shm = shm->next)
+  {
+    if (shm->name == name && shm->size >= size)
+    {
+      WSEGLDRI2UnlinkShm(display, shm);
+      goto found;
+    }
+  }
+
+  shm = (wsegldri2_shm *)calloc(1, sizeof(*shm));
+  STAT_ADD(allocations, 1);
+
+  if (!shm)
+    return NULL;
+
+  shm->name = name;
+  shm->size = size;
+  shm->shmaddr = shmat(name, 0, 0);
+
+  if (shm->shmaddr == (void *)-1)
+  {
+    free(shm);
+    return NULL;
+  }
+
+  pagesize = getpagesize();
+  flags = (size + pagesize - 1) / pagesize;
+
+  STAT_ADD(mem_wraps, 1);
+
+  err = PVR2DMemWrap(display->pvr_context, shm->shmaddr, flags == 1, size,
+                     NULL, &shm->pvr_meminfo);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_MEM_WRAP, err, name, size,
+                             shm->pvr_meminfo);
+  }
+
+  if (err)
+  {
+    shmdt(shm->shmaddr);
+    free(shm);
+    return NULL;
+  }
+
+found:
+  shm->ref_cnt++;
+  shm->next = display->shm_cache;
+
+  if (shm->next)
+    shm->next->prev = shm;
+
+  display->shm_cache = shm;
+
+  return shm;
+}
+
+static void
+WSEGLDRI2ReleaseShm(wsegldri2_display *display, wsegldri2_shm *shm)
+{
+  shm->ref_cnt--;
+  WSEGLDRI2TrimShmCache(display);
+}
+
+static void
+WSEGLDRI2FreeStaging(wsegldri2_display *display, wsegldri2_staging *staging)
+{
+  XShmDetach(display->dpy, &staging->info);
+
+  if (staging->pvr_meminfo)
+  {
+    PVR2DQueryBlitsComplete(display->pvr_context, staging->pvr_meminfo,
+                            PVR2D_TRUE);
+    PVR2DMemFree(display->pvr_context, staging->pvr_meminfo);
+  }
+
+  shmdt(staging->info.shmaddr);
+  free(staging);
+}
+
+/* Size class of a buffer of size bytes, STAGING_CLASSES if too big to pool */
+static int
+WSEGLDRI2StagingClass(unsigned long size)
+{
+  unsigned long pages = (size + getpagesize() - 1) / getpagesize();
+  int size_class = 0;
+
+  while (size_class < STAGING_CLASSES && (1UL << size_class) < pages)
+    size_class++;
+
+  return size_class;
+}
+
+/*
+ * Get a shm segment of at least size bytes, attached to the server. Comes
+ * from the pool when there is one of the size, created otherwise.
+ */
+static wsegldri2_staging *
+WSEGLDRI2GetStaging(wsegldri2_display *display, unsigned long size)
+{
+  int size_class = WSEGLDRI2StagingClass(size);
+  wsegldri2_staging *staging;
+
+  if (size_class < STAGING_CLASSES && display->staging_pool[size_class])
+  {
+    staging = display->staging_pool[size_class];
+    display->staging_pool[size_class] = staging->next;
+    display->staging_pooled -= staging->size;
+    return staging;
+  }
+
+  staging = (wsegldri2_staging *)calloc(1, sizeof(*staging));
+  STAT_ADD(allocations, 1);
+
+  if (!staging)
+    return NULL;
+
+  if (size_class < STAGING_CLASSES)
+    staging->size = (1UL << size_class) * getpagesize();
+  else
+    staging->size = (size + getpagesize() - 1) & ~(getpagesize() - 1);
+
+  staging->info.shmid = shmget(IPC_PRIVATE, staging->size, IPC_CREAT | 0600);
+
+  if (staging->info.shmid == -1)
+    goto err;
+
+  staging->info.shmaddr = shmat(staging->info.shmid, 0, 0);
+
+  if (staging->info.shmaddr == (void *)-1)
+  {
+    shmctl(staging->info.shmid, IPC_RMID, NULL);
+    goto err;
+  }
+
+  staging->info.readOnly = True;
+  STAT_ADD(shm_attaches, 1);
+
+  if (!XShmAttach(display->dpy, &staging->info))
+  {
+    shmdt(staging->info.shmaddr);
+    shmctl(staging->info.shmid, IPC_RMID, NULL);
+    goto err;
+  }
+
+  /* Once the server has attached, the segment can go away with its users */
+  XSync(display->dpy, False);
+  STAT_ADD(round_trips, 1);
+  shmctl(staging->info.shmid, IPC_RMID, NULL);
+
+  return staging;
+
+err:
+  free(staging);
+
+  return NULL;
+}
+
+/*
+ * Give a staging buffer back once the server is done reading it. Pooled as
+ * long as it fits in the cache budget along with the idle server mappings.
+ */
+static void
+WSEGLDRI2PutStaging(wsegldri2_display *display, wsegldri2_staging *staging)
+{
+  int size_class = WSEGLDRI2StagingClass(staging->size);
+  unsigned long idle = display->staging_pooled + staging->size;
+  wsegldri2_shm *shm;
+
+  for (shm = display->shm_cache; shm; shm = shm->next)
+  {
+    if (!shm->ref_cnt)
+      idle += shm->size;
+  }
+
+  if (size_class >= STAGING_CLASSES || idle > display->shm_cache_budget)
+  {
+    WSEGLDRI2FreeStaging(display, staging);
+    return;
+  }
+
+  staging->next = display->staging_pool[size_class];
+  display->staging_pool[size_class] = staging;
+  display->staging_pooled += staging->size;
+}
+
+/* Attach a server buffer to the server once more, as an MIT-SHM segment */
+static Bool
+WSEGLDRI2AttachShm(wsegldri2_display *display, wsegldri2_shm *shm)
+{
+  XShmSegmentInfo info;
+
+  if (shm->shmseg)
+    return True;
+
+  info.shmid = shm->name;
+  info.shmaddr = shm->shmaddr;
+  info.readOnly = True;
+  STAT_ADD(shm_attaches, 1);
+
+  if (!XShmAttach(display->dpy, &info))
+    return False;
+
+  shm->shmseg = info.shmseg;
+
+  return True;
+}
+
+/* GCs can be shared by all drawables of the same depth */
+static GC
+WSEGLDRI2GetGC(wsegldri2_display *display, Drawable drawable,
+               unsigned int depth)
+{
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(display->gcs); i++)
+  {
+    if (!display->gcs[i].gc)
+    {
+      display->gcs[i].gc = XCreateGC(display->dpy, drawable, 0, 0);
+      display->gcs[i].depth = depth;
+    }
+
+    if (display->gcs[i].depth == depth)
+      return display->gcs[i].gc;
+  }
+
+  return NULL;
+}
+
+static WSEGLError
+WSEGLDRI2IsDisplayValid(NativeDisplayType nativeDisplay)
+{
+  Display *dpy = nativeDisplay;
+  WSEGLError rv;
+  LOG();
+  if (!nativeDisplay)
+  {
+    nativeDisplay = XOpenDisplay(0);
+
+    if (!nativeDisplay)
+      return WSEGL_BAD_NATIVE_DISPLAY;
+  }
+
+  if (*DisplayString(nativeDisplay) == ':')
+    rv = WSEGL_SUCCESS;
+  else
+    rv = WSEGL_BAD_NATIVE_DISPLAY;
+
+  if (!dpy)
+    XCloseDisplay(nativeDisplay);
+
+  return rv;
+}
+
+static void
+WSEGLDRI2InitCaps(wsegldri2_display *display, int use_hw_sync)
+{
+  WSEGLCaps *caps = display->caps;
+
+  /*
+   * Window and pixmap buffers are both wrapped server memory, so the server
+   * sees the SGX sync objects of either.
+   */
+  if (use_hw_sync)
+  {
+    caps->eCapsType = WSEGL_CAP_WINDOWS_USE_HW_SYNC;
+    caps->ui32CapsValue = 1;
+    caps++;
+    caps->eCapsType = WSEGL_CAP_PIXMAPS_USE_HW_SYNC;
+    caps->ui32CapsValue = 1;
+    caps++;
+  }
+
+  /* Swap intervals are implemented with the DRI2 1.2 MSC requests */
+  if (display->dri2_minor >= 2)
+  {
+    caps->eCapsType = WSEGL_CAP_MIN_SWAP_INTERVAL;
+    caps->ui32CapsValue = 0;
+    caps++;
+    caps->eCapsType = WSEGL_CAP_MAX_SWAP_INTERVAL;
+    caps->ui32CapsValue = max_swap_interval;
+    caps++;
+  }
+
+  caps->eCapsType = WSEGL_NO_CAPS;
+  caps->ui32CapsValue = 0;
+}
+
+/*
+ * Servers may ignore the format asked for with GetBuffersWithFormat. Ask for
+ * a 16 bit back buffer for a scratch window of the root depth and see what
+ * comes back.
+ */
+static Bool
+WSEGLDRI2Has16BitBackBuffers(Display *dpy)
+{
+  unsigned int attachments[2] = { WSEGL_DRAWABLE_WINDOW, 16 };
+  DRI2Buffer *buffers;
+  Window window;
+  Bool supported;
+  int width;
+  int height;
+  int count;
+
+  window = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), 0, 0, 1, 1, 0, 0,
+                               0);
+  DRI2CreateDrawable(dpy, window);
+
+  STAT_ADD(round_trips, 1);
+  buffers = DRI2GetBuffersReply(dpy,
+                                DRI2GetBuffersWithFormatRequest(dpy, window,
+                                                                attachments,
+                                                                1),
+                                &width, &height, &count);
+  supported = buffers && count == 1 && buffers->cpp == 2;
+  free(buffers);
+
+  DRI2DestroyDrawable(dpy, window);
+  XDestroyWindow(dpy, window);
+
+  return supported;
+}
+
+static WSEGLError
+WSEGLDRI2OpenDisplay(NativeDisplayType dpy, wsegldri2_display **handle)
+{
+  wsegldri2_display *display;
+  WSEGLError rv;
+  int num_devs;
+  PVR2DDEVICEINFO *dev_info;
+  PVR2DDISPLAYINFO pDisplayInfo;
+  unsigned int dev_id;
+  int i;
+  XVisualInfo *visuals;
+  int n;
+  int minor;
+  int major;
+  int errorBase;
+  int eventBase;
+  unsigned int cookie;
+  void *state;
+  int use_hw_sync;
+  unsigned int frames_in_flight;
+  unsigned int shm_cache_kb;
+  unsigned int pvDefault = 1;
+  unsigned int framesDefault = 2;
+  unsigned int shmCacheDefault = 8192;
+  char stats_file[PATH_MAX];
+  unsigned int stats_period;
+  unsigned int statsPeriodDefault = 10;
+  char trace_path[PATH_MAX];
+  char record_path[PATH_MAX];
+  unsigned int use_flip_chain;
+  unsigned int flipDefault = 1;
+  unsigned int back_buffers;
+  unsigned int backBuffersDefault = 2;
+  unsigned int trace_count;
+  unsigned int traceEventsDefault = 0;
+  int num_visuals;
+  int num_visuals_565;
+
+  PVRSRVCreateAppHintState(IMG_EGL, 0, &state);
+  PVRSRVGetAppHint(state, "WSEGL_UseHWSync", IMG_UINT_TYPE, &pvDefault,
+                   &use_hw_sync);
+  PVRSRVGetAppHint(state, "WSEGL_FramesInFlight", IMG_UINT_TYPE,
+                   &framesDefault, &frames_in_flight);
+  PVRSRVGetAppHint(state, "WSEGL_BackBuffers", IMG_UINT_TYPE,
+                   &backBuffersDefault, &back_buffers);
+  PVRSRVGetAppHint(state, "WSEGL_ShmCacheKB", IMG_UINT_TYPE,
+                   &shmCacheDefault, &shm_cache_kb);
+  PVRSRVGetAppHint(state, "WSEGL_StatisticsFile", IMG_STRING_TYPE, "",
+                   stats_file);
+  PVRSRVGetAppHint(state, "WSEGL_StatisticsPeriod", IMG_UINT_TYPE,
+                   &statsPeriodDefault, &stats_period);
+  PVRSRVGetAppHint(state, "WSEGL_TraceEvents", IMG_UINT_TYPE,
+                   &traceEventsDefault, &trace_count);
+  PVRSRVGetAppHint(state, "WSEGL_TraceFile", IMG_STRING_TYPE, "",
+                   trace_path);
+  PVRSRVGetAppHint(state, "WSEGL_RecordFile", IMG_STRING_TYPE, "",
+                   record_path);
+  PVRSRVGetAppHint(state, "WSEGL_UseFlipChain", IMG_UINT_TYPE, &flipDefault,
+                   &use_flip_chain);
+  PVRSRVFreeAppHintState(IMG_EGL, state);
+
+  WSEGLDRI2OpenStatisticsFile(stats_file, stats_period);
+  WSEGLDRI2OpenTrace(trace_path, trace_count);
+  WSEGLDRI2OpenRecord(record_path);
+
+  display = (wsegldri2_display *)calloc(1, sizeof(*display));
+
+  if (!display)
+    return WSEGL_OUT_OF_MEMORY;
+
+  display->ref_cnt = 1;
+  display->native_dpy = dpy;
+  pthread_mutex_init(&display->lock, NULL);
+  pthread_mutex_init(&display->drawables_lock, NULL);
+  pthread_mutex_init(&display->reaper_lock, NULL);
+  pthread_cond_init(&display->reaper_cond, NULL);
+
+  rv = WSEGL_CANNOT_INITIALISE;
+
+  if (!dpy)
+  {
+    dpy = XOpenDisplay(WSEGL_DEFAULT_DISPLAY);
+
+    if (!dpy)
+      goto free_display;
+
+    display->default_dpy = WSEGL_TRUE;
+  }
+  else
+    display->default_dpy = WSEGL_FALSE;
+
+  num_devs = PVR2DEnumerateDevices(NULL);
+
+  if (num_devs <= 0)
+    goto err;
+
+  dev_info = (PVR2DDEVICEINFO *)malloc(24 * num_devs);
+
+  if (!dev_info)
+  {
+    rv = WSEGL_OUT_OF_MEMORY;
+    goto err;
+  }
+
+  if (PVR2DEnumerateDevices(dev_info))
+  {
+    free(dev_info);
+    goto err;
+  }
+
+  dev_id = dev_info->ulDevID;
+  free(dev_info);
+
+  if (PVR2DCreateDeviceContext(dev_id, &display->pvr_context, 0))
+    goto err;
+
+  display->dpy = dpy;
+
+  if (PVR2DGetDeviceInfo(display->pvr_context, &pDisplayInfo))
+    goto err;
+
+  display->fb_info = pDisplayInfo;
+
+  if (use_flip_chain && pDisplayInfo.ulMaxFlipChains &&
+      pDisplayInfo.ulMaxBuffersInChain >= 2)
+  {
+    display->flip_buffers = pDisplayInfo.ulMaxBuffersInChain;
+
+    if (display->flip_buffers > 3)
+      display->flip_buffers = 3;
+  }
+
+  /* The first lookup of the extension on a connection asks the server */
+  STAT_ADD(round_trips, 1);
+
+  if(!DRI2QueryExtension(dpy, &eventBase, &errorBase))
+    goto context_err;
+
+  /* The version reply comes back with the MIT-SHM queries */
+  cookie = DRI2QueryVersionRequest(display->dpy);
+  display->has_shm = XShmQueryExtension(dpy);
+
+  /* Only fullscreen windows that flip are rendered rotated */
+  if (display->flip_buffers)
+    display->has_randr = XRRQueryExtension(dpy, &eventBase, &errorBase);
+
+  STAT_ADD(round_trips, 1);
+
+  if(!DRI2QueryVersionReply(display->dpy, cookie, &major, &minor))
+    goto context_err;
+
+  if (major != WSEGL_VERSION)
+    goto context_err;
+
+  display->dri2_minor = minor;
+  /* Idle server mappings and pooled staging buffers share the one budget */
+  display->shm_cache_budget = shm_cache_kb * 1024UL;
+  /*
+   * Only how many buffers a flip chain gets, WSEGL_FramesInFlight alone
+   * limits the swaps queued to the server.
+   */
+  display->back_buffers = back_buffers < 2 ? 1 : 2;
+
+  /* SwapBuffers needs DRI2 1.2, a limit of 0 keeps the synchronous copy */
+  if (minor >= 2)
+    display->frames_in_flight = frames_in_flight;
+  else
+    display->frames_in_flight = 0;
+
+  visuals = XGetVisualInfo(dpy, 0, 0, &num_visuals);
+  num_visuals_565 = num_visuals;
+
+  if (!visuals)
+  {
+    rv = WSEGL_BAD_NATIVE_DISPLAY;
+    fputs("XGetVisualInfo() returned NULL!\n", stderr);
+    goto context_err;
+  }
+
+  /* Room for a 565 window config per deep visual */
+  display->configs =
+      (WSEGLConfig *)calloc(2 * num_visuals + 1, sizeof(WSEGLConfig));
+
+  if (!display->configs)
+  {
+    XFree(visuals);
+    rv = WSEGL_OUT_OF_MEMORY;
+    goto context_err;
+  }
+
+  for (i = 0, n = 0; i < num_visuals; i++)
+  {
+    WSEGLConfig *config = &display->configs[n];
+    XVisualInfo *visual = &visuals[i];
+
+    switch (visual->depth)
+    {
+      case 24:
+      case 32:
+          config->ePixelFormat = WSEGL_PIXELFORMAT_8888;
+          break;
+      case 16:
+        config->ePixelFormat = WSEGL_PIXELFORMAT_565;
+        break;
+      default:
+        continue;
+    }
+
+    config->ui32DrawableType = WSEGL_DRAWABLE_WINDOW | WSEGL_DRAWABLE_PIXMAP;
+    config->ulNativeRenderable = WSEGL_TRUE;
+    config->ulNativeVisualID = visual->visualid;
+    n++;
+  }
+
+  /*
+   * With GetBuffersWithFormat, windows of any depth can have 16 bit back
+   * buffers, the server converts when it copies them to the front. Pixmaps
+   * are their own buffer, so they keep the format of their depth. Only if
+   * the server really hands them out.
+   */
+  if (minor < 1 || !WSEGLDRI2Has16BitBackBuffers(dpy))
+    num_visuals_565 = 0;
+
+  for (i = 0; i < num_visuals_565; i++)
+  {
+    WSEGLConfig *config = &display->configs[n];
+    XVisualInfo *visual = &visuals[i];
+
+    if (visual->depth != 24 && visual->depth != 32)
+      continue;
+
+    config->ePixelFormat = WSEGL_PIXELFORMAT_565;
+    config->ui32DrawableType = WSEGL_DRAWABLE_WINDOW;
+    config->ulNativeRenderable = WSEGL_FALSE;
+    config->ulNativeVisualID = visual->visualid;
+    n++;
+  }
+
+  XFree(visuals);
+  WSEGLDRI2InitCaps(display, use_hw_sync);
+  *handle = display;
+
+  return WSEGL_SUCCESS;
+
+context_err:
+  PVR2DDestroyDeviceContext(display->pvr_context);
+
+err:
+  if (display->default_dpy == WSEGL_TRUE)
+    XCloseDisplay(dpy);
+
+free_display:
+  pthread_cond_destroy(&display->reaper_cond);
+  pthread_mutex_destroy(&display->reaper_lock);
+  pthread_mutex_destroy(&display->drawables_lock);
+  pthread_mutex_destroy(&display->lock);
+  free(display);
+
+  return rv;
+}
+
+static void
+WSEGLDRI2FreeDisplay(wsegldri2_display *display)
+{
+  int i;
+
+  while (display->shm_cache)
+  {
+    wsegldri2_shm *shm = display->shm_cache;
+
+    WSEGLDRI2UnlinkShm(display, shm);
+    WSEGLDRI2FreeSharedMemory(display, shm);
+  }
+
+  /* Lets the reaper drain its list first */
+  WSEGLDRI2StopReaper(display);
+
+  for (i = 0; i < STAGING_CLASSES; i++)
+  {
+    while (display->staging_pool[i])
+    {
+      wsegldri2_staging *staging = display->staging_pool[i];
+
+      display->staging_pool[i] = staging->next;
+      WSEGLDRI2FreeStaging(display, staging);
+    }
+  }
+
+  free(display->image_buf);
+
+  for (i = 0; i < ARRAY_SIZE(display->gcs) && display->gcs[i].gc; i++)
+    XFreeGC(display->dpy, display->gcs[i].gc);
+
+  PVR2DDestroyDeviceContext(display->pvr_context);
+
+  if (display->default_dpy)
+    XCloseDisplay(display->dpy);
+
+  pthread_cond_destroy(&display->reaper_cond);
+  pthread_mutex_destroy(&display->reaper_lock);
+  pthread_mutex_destroy(&display->drawables_lock);
+  pthread_mutex_destroy(&display->lock);
+  free(display->configs);
+  free(display);
+}
+
+/* Must be called with the display lock held */
+static wsegldri2_display *
+WSEGLDRI2FindNativeDisplay(NativeDisplayType dpy)
+{
+  wsegldri2_display *display;
+
+  for (display = displays; display; display = display->next)
+  {
+    if (display->native_dpy == dpy)
+      break;
+  }
+
+  return display;
+}
+
+/* Must be called with the display lock held */
+static wsegldri2_display *
+WSEGLDRI2FindDisplay(Display *dpy)
+{
+  wsegldri2_display *display;
+
+  for (display = displays; display; display = display->next)
+  {
+    if (display->dpy == dpy)
+      break;
+  }
+
+  return display;
+}
+
+/* Take a reference on a display found in the displays list */
+static void
+WSEGLDRI2RefDisplay(wsegldri2_display *display)
+{
+  __sync_add_and_fetch(&display->ref_cnt, 1);
+}
+
+static WSEGLError
+WSEGLDRI2InitialiseDisplay(NativeDisplayType dpy, WSEGLDisplayHandle* handle,
+                           const WSEGLCaps **caps, WSEGLConfig **configs)
+{
+  wsegldri2_display **display = (wsegldri2_display **)handle;
+  wsegldri2_display *new_display;
+  wsegldri2_display *found;
+  WSEGLError rv;
+  LOG();
+
+  pthread_mutex_lock(&display_lock);
+  found = WSEGLDRI2FindNativeDisplay(dpy);
+
+  if (found)
+    WSEGLDRI2RefDisplay(found);
+
+  pthread_mutex_unlock(&display_lock);
+
+  /*
+   * Each native display gets its own connection, PVR2D context and configs.
+   * Talking to the server is done without the display lock, so the DRI2
+   * event callbacks can always take it.
+   */
+  if (!found)
+  {
+    rv = WSEGLDRI2OpenDisplay(dpy, &new_display);
+
+    if (rv != WSEGL_SUCCESS)
+      return rv;
+
+    pthread_mutex_lock(&display_lock);
+
+    /* Somebody else may have opened it while we were not looking */
+    found = WSEGLDRI2FindNativeDisplay(dpy);
+
+    if (found)
+      WSEGLDRI2RefDisplay(found);
+    else
+    {
+      new_display->next = displays;
+      displays = new_display;
+      found = new_display;
+      new_display = NULL;
+    }
+
+    pthread_mutex_unlock(&display_lock);
+
+    if (new_display)
+      WSEGLDRI2FreeDisplay(new_display);
+  }
+
+  *display = found;
+  *caps = found->caps;
+  *configs = found->configs;
+
+  return WSEGL_SUCCESS;
+}
+
+static WSEGLError
+WSEGLDRI2CloseDisplay(WSEGLDisplayHandle handle)
+{
+  wsegldri2_display *wsegl_dpy = (wsegldri2_display *)handle;
+  wsegldri2_display **link;
+  unsigned long ref_cnt;
+  LOG();
+
+  /* Only the last reference needs the lock */
+  while ((ref_cnt = wsegl_dpy->ref_cnt) > 1)
+  {
+    if (__sync_bool_compare_and_swap(&wsegl_dpy->ref_cnt, ref_cnt, ref_cnt - 1))
+      return WSEGL_SUCCESS;
+  }
+
+  pthread_mutex_lock(&display_lock);
+
+  if (__sync_sub_and_fetch(&wsegl_dpy->ref_cnt, 1))
+  {
+    pthread_mutex_unlock(&display_lock);
+    return WSEGL_SUCCESS;
+  }
+
+  for (link = &displays; *link; link = &(*link)->next)
+  {
+    if (*link == wsegl_dpy)
+    {
+      *link = wsegl_dpy->next;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&display_lock);
+
+  WSEGLDRI2FreeDisplay(wsegl_dpy);
+
+  return WSEGL_SUCCESS;
+}
+
+/*
+ * Ask for the buffers of a drawable, in the pixel format of its config when
+ * the server lets us choose (DRI2 1.1 and later). Returns the cookie for the
+ * reply and how many buffers were asked for in count.
+ */
+static unsigned int
+WSEGLDRI2RequestBuffers(wsegldri2_drawable *drawable, int *count)
+{
+  wsegldri2_display *display = drawable->display;
+  unsigned int format = bpp[drawable->pixel_format] * 8;
+  unsigned int attachments[4];
+
+  if (drawable->drawable_type == WSEGL_DRAWABLE_WINDOW)
+  {
+    attachments[0] = WSEGL_DRAWABLE_WINDOW;
+    attachments[1] = 0;
+    *count = 2;
+  }
+  else
+  {
+    attachments[0] = 0;
+    *count = 1;
+  }
+
+  if (display->dri2_minor < 1)
+  {
+    return DRI2GetBuffersRequest(display->dpy, drawable->nativePixmap,
+                                 attachments, *count);
+  }
+
+  attachments[3] = format;
+  attachments[2] = attachments[1];
+  attachments[1] = format;
+
+  return DRI2GetBuffersWithFormatRequest(display->dpy, drawable->nativePixmap,
+                                         attachments, *count);
+}
+
+/* Size of the buffer the GPU renders into, the window turned if rotated */
+static void
+WSEGLDRI2RenderSize(wsegldri2_drawable *drawable, unsigned long *width,
+                    unsigned long *height)
+{
+  if (drawable->rotation == WSEGL_ROTATE_90 ||
+      drawable->rotation == WSEGL_ROTATE_270)
+  {
+    *width = drawable->height;
+    *height = drawable->width;
+  }
+  else
+  {
+    *width = drawable->width;
+    *height = drawable->height;
+  }
+}
+
+/* The front buffer and the back buffers asked for, as far as PVR2D goes */
+static unsigned long
+WSEGLDRI2FlipChainLength(wsegldri2_drawable *drawable)
+{
+  unsigned long length = drawable->back_buffers + 1;
+
+  if (length > drawable->display->flip_buffers)
+    length = drawable->display->flip_buffers;
+
+  return length;
+}
+
+static void
+WSEGLDRI2DestroyFlipChain(wsegldri2_drawable *drawable)
+{
+  wsegldri2_display *display = drawable->display;
+  PVR2DMEMINFO *framebuffer;
+  PVR2DBLTINFO blt;
+  PVR2DERROR err;
+
+  /* Leave the last frame on the screen for whoever draws there next */
+  if (drawable->flip_presented &&
+      !PVR2DGetFrameBuffer(display->pvr_context, 0, &framebuffer))
+  {
+    unsigned long front = (drawable->flip_back +
+                           drawable->num_flip_buffers - 1) %
+                          drawable->num_flip_buffers;
+
+    memset(&blt, 0, sizeof(blt));
+    blt.CopyCode = PVR2DROPcopy;
+    blt.BlitFlags = PVR2D_BLIT_DISABLE_ALL;
+    blt.pSrcMemInfo = drawable->flip_buffers[front];
+    blt.SrcStride = drawable->flip_stride;
+    blt.SrcFormat = display->fb_info.eFormat;
+    blt.SrcSurfWidth = display->fb_info.ulWidth;
+    blt.SrcSurfHeight = display->fb_info.ulHeight;
+    blt.SizeX = display->fb_info.ulWidth;
+    blt.SizeY = display->fb_info.ulHeight;
+    blt.pDstMemInfo = framebuffer;
+    blt.DstStride = display->fb_info.lStride;
+    blt.DstFormat = display->fb_info.eFormat;
+    blt.DstSurfWidth = display->fb_info.ulWidth;
+    blt.DstSurfHeight = display->fb_info.ulHeight;
+    blt.DSizeX = display->fb_info.ulWidth;
+    blt.DSizeY = display->fb_info.ulHeight;
+
+    if (!WSEGLDRI2Blt(display->pvr_context, &blt, drawable->nativePixmap))
+      PVR2DQueryBlitsComplete(display->pvr_context, framebuffer, PVR2D_TRUE);
+
+    PVR2DMemFree(display->pvr_context, framebuffer);
+  }
+
+  err = PVR2DDestroyFlipChain(display->pvr_context, drawable->flip_chain);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_DESTROY_FLIP_CHAIN, err,
+                             drawable->num_flip_buffers, 0, NULL);
+  }
+
+  drawable->flip_chain = NULL;
+}
+
+/*
+ * Flips don't go through the server, so the swap interval has to be handed
+ * to PVR2D, within what the display can do.
+ */
+static void
+WSEGLDRI2SetFlipInterval(wsegldri2_drawable *drawable)
+{
+  wsegldri2_display *display = drawable->display;
+  PVR2D_ULONG interval = drawable->swap_interval;
+  PVR2DERROR err;
+
+  if (interval < display->fb_info.ulMinFlipInterval)
+    interval = display->fb_info.ulMinFlipInterval;
+
+  if (interval > display->fb_info.ulMaxFlipInterval)
+    interval = display->fb_info.ulMaxFlipInterval;
+
+  err = PVR2DSetPresentFlipProperties(display->pvr_context,
+                                      drawable->flip_chain,
+                                      PVR2D_PRESENT_PROPERTY_INTERVAL, 0, 0, 0,
+                                      NULL, interval);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_SET_FLIP_INTERVAL, err,
+                             interval, 0, NULL);
+  }
+}
+
+/*
+ * Flip instead of rendering into the framebuffer when the server lets a
+ * window scan out directly. Only if the window covers the whole screen in
+ * the format of the screen.
+ */
+static Bool
+WSEGLDRI2CreateFlipChain(wsegldri2_drawable *drawable)
+{
+  wsegldri2_display *display = drawable->display;
+  PVR2DFORMAT format = pvr2d_format[drawable->pixel_format];
+  PVR2D_ULONG num_buffers = WSEGLDRI2FlipChainLength(drawable);
+  PVR2D_ULONG id;
+  unsigned long width;
+  unsigned long height;
+  PVR2DERROR err;
+
+  WSEGLDRI2RenderSize(drawable, &width, &height);
+
+  if (!display->flip_buffers || format != display->fb_info.eFormat ||
+      width != display->fb_info.ulWidth || height != display->fb_info.ulHeight)
+  {
+    return False;
+  }
+
+  err = PVR2DCreateFlipChain(display->pvr_context, 0, num_buffers,
+                             width, height, format, &drawable->flip_stride,
+                             &id, &drawable->flip_chain);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_CREATE_FLIP_CHAIN, err,
+                             num_buffers, drawable->flip_stride * height,
+                             NULL);
+  }
+
+  if (err)
+  {
+    drawable->flip_chain = NULL;
+    return False;
+  }
+
+  drawable->flip_length = num_buffers;
+  err = PVR2DGetFlipChainBuffers(display->pvr_context, drawable->flip_chain,
+                                 &num_buffers, drawable->flip_buffers);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_GET_FLIP_CHAIN_BUFFERS, err,
+                             num_buffers, drawable->flip_stride * height,
+                             drawable->flip_buffers[0]);
+  }
+
+  if (err || num_buffers < 2 ||
+      num_buffers > ARRAY_SIZE(drawable->flip_buffers))
+  {
+    drawable->flip_presented = False;
+    WSEGLDRI2DestroyFlipChain(drawable);
+    return False;
+  }
+
+  drawable->num_flip_buffers = num_buffers;
+  drawable->flip_back = 0;
+  drawable->flip_presented = False;
+  memset(drawable->presented, 0, sizeof(drawable->presented));
+  WSEGLDRI2SetFlipInterval(drawable);
+
+  return True;
+}
+
+/*
+ * On a rotated screen a fullscreen window can only flip if the GPU renders
+ * it turned the way the panel scans out, saving the compositor the rotated
+ * copy of every frame.
+ */
+static WSEGLRotationAngle
+WSEGLDRI2GetRotation(wsegldri2_display *display, wsegldri2_drawable *drawable,
+                     Window root)
+{
+  WSEGLRotationAngle rotation;
+  Rotation current;
+  unsigned long width;
+  unsigned long height;
+
+  if (!display->has_randr || drawable->drawable_type != WSEGL_DRAWABLE_WINDOW ||
+      pvr2d_format[drawable->pixel_format] != display->fb_info.eFormat)
+  {
+    return WSEGL_ROTATE_0;
+  }
+
+  STAT_ADD(round_trips, 1);
+  XRRRotations(display->dpy, XRRRootToScreen(display->dpy, root), &current);
+
+  switch (current & (RR_Rotate_0 | RR_Rotate_90 | RR_Rotate_180 |
+                     RR_Rotate_270))
+  {
+    case RR_Rotate_90:
+      rotation = WSEGL_ROTATE_90;
+      break;
+    case RR_Rotate_180:
+      rotation = WSEGL_ROTATE_180;
+      break;
+    case RR_Rotate_270:
+      rotation = WSEGL_ROTATE_270;
+      break;
+    default:
+      return WSEGL_ROTATE_0;
+  }
+
+  drawable->rotation = rotation;
+  WSEGLDRI2RenderSize(drawable, &width, &height);
+  drawable->rotation = WSEGL_ROTATE_0;
+
+  if (width != display->fb_info.ulWidth || height != display->fb_info.ulHeight)
+    return WSEGL_ROTATE_0;
+
+  return rotation;
+}
+
+static WSEGLError
+WSEGLDRI2GetDrawableInfo(wsegldri2_display *display, WSEGLConfig *config,
+                         WSEGLDrawableHandle *drawable,
+                         NativePixmapType nativePixmap,
+                         WSEGLRotationAngle *rotationAngle, int drawable_type)
+{
+  WSEGLError rv;
+  wsegldri2_drawable *handle;
+  Window window;
+  int tmp;
+  unsigned int depth;
+  unsigned int border_width;
+  Status status;
+  int count;
+  unsigned long long trace_start;
+
+  LOG();
+
+  TRACE_BEGIN(trace_start);
+
+  if (!nativePixmap)
+  {
+    if (drawable_type == WSEGL_DRAWABLE_WINDOW)
+      return WSEGL_BAD_NATIVE_WINDOW;
+    else
+      return WSEGL_BAD_NATIVE_PIXMAP;
+  }
+
+  if (!config || !(drawable_type & config->ui32DrawableType) )
+    return WSEGL_BAD_CONFIG;
+
+  handle = (wsegldri2_drawable *)calloc(1, sizeof(*handle));
+  STAT_ADD(allocations, 1);
+
+  if (!handle)
+    return WSEGL_OUT_OF_MEMORY;
+
+  handle->drawable_type = drawable_type;
+  handle->display = display;
+
+  if (drawable_type == WSEGL_DRAWABLE_WINDOW)
+    handle->swap_interval = 1;
+
+  handle->nativePixmap = nativePixmap;
+  handle->back_buffers = display->back_buffers;
+
+  STAT_ADD(round_trips, 1);
+
+  if ((status =
+       XGetGeometry(display->dpy, nativePixmap, &window, &tmp, &tmp,
+                    &handle->width, &handle->height, &border_width, &depth)))
+  {
+    Bool is_supported;
+
+    if (depth == 24 || depth == 32)
+    {
+      is_supported = config->ePixelFormat == WSEGL_PIXELFORMAT_8888 ||
+          (config->ePixelFormat == WSEGL_PIXELFORMAT_565 &&
+           drawable_type == WSEGL_DRAWABLE_WINDOW &&
+           display->dri2_minor >= 1);
+    }
+    else
+    {
+      if (depth != 16)
+      {
+        rv = WSEGL_BAD_DRAWABLE;
+        goto err;
+      }
+
+      is_supported = config->ePixelFormat == WSEGL_PIXELFORMAT_565;
+    }
+
+    if (is_supported)
+    {
+      handle->pixel_format = config->ePixelFormat;
+      handle->rotation = WSEGLDRI2GetRotation(display, handle, window);
+
+      /*
+       * Only render rotated for a window that really flips. Once it stops,
+       * it renders aside and turns every frame back, but never fails.
+       */
+      if (handle->rotation != WSEGL_ROTATE_0)
+      {
+        if (WSEGLDRI2CreateFlipChain(handle))
+        {
+          handle->name = -1;
+          handle->pvr_meminfo = handle->flip_buffers[handle->flip_back];
+        }
+        else
+          handle->rotation = WSEGL_ROTATE_0;
+      }
+
+      handle->stride = (handle->width + 0x1F) & ~0x1Fu;
+      *drawable = handle;
+      *rotationAngle = handle->rotation;
+
+      pthread_mutex_init(&handle->lock, NULL);
+      pthread_mutex_lock(&display->drawables_lock);
+      handle->next = display->drawables;
+      display->drawables = handle;
+      pthread_mutex_unlock(&display->drawables_lock);
+      thread_display = display;
+
+      DRI2CreateDrawable(display->dpy, nativePixmap);
+
+      /*
+       * Ask for the buffers right away, the reply is collected by the first
+       * GetDrawableParameters and the round trip overlaps with whatever the
+       * application does in between.
+       */
+      handle->cookie_serial = handle->invalidate_serial;
+      handle->buffers_cookie = WSEGLDRI2RequestBuffers(handle, &count);
+      XFlush(display->dpy);
+
+      TRACE_END("CreateDrawable", trace_start, nativePixmap, 0);
+
+      return WSEGL_SUCCESS;
+    }
+
+    rv = WSEGL_BAD_CONFIG;
+  }
+  else
+  {
+    rv = WSEGL_BAD_DRAWABLE;
+    fprintf(stderr,
+            "WSEGLDRI2GetDrawableInfo: Failed to get X drawable geometry - status %d\n",
+            status);
+    fputs("WSEGL_CreateWindowDrawable: Bad drawable\n", stderr);
+  }
+
+err:
+
+  free(handle);
+
+  return rv;
+}
+
+static WSEGLError
+WSEGLDRI2CreateWindowDrawable(WSEGLDisplayHandle display, WSEGLConfig *config,
+                              WSEGLDrawableHandle *drawable,
+                              NativeWindowType nativeWindow,
+                              WSEGLRotationAngle *rotationAngle)
+{
+  LOG();
+
+  return WSEGLDRI2GetDrawableInfo((wsegldri2_display *)display, config,
+                                  drawable, nativeWindow, rotationAngle,
+                                  WSEGL_DRAWABLE_WINDOW);
+}
+
+static WSEGLError
 WSEGLDRI2CreatePixmapDrawable(WSEGLDisplayHandle display, WSEGLConfig *config,
                               WSEGLDrawableHandle *drawable,
                               NativePixmapType nativePixmap,
@@ -375,76 +2106,1034 @@ WSEGLDRI2CreatePixmapDrawable(WSEGLDisplayHandle display, WSEGLConfig *config,
 {
   LOG();
 
-  return WSEGLDRI2GetDrawableInfo((wsegldri2_display *)display, config,
-                                  drawable, nativePixmap, rotationAngle,
-                                  WSEGL_DRAWABLE_PIXMAP);
+  return WSEGLDRI2GetDrawableInfo((wsegldri2_display *)display, config,
+                                  drawable, nativePixmap, rotationAngle,
+                                  WSEGL_DRAWABLE_PIXMAP);
+}
+
+static Bool
+WSEGLDRI2AllocRotated(wsegldri2_drawable *drawable)
+{
+  unsigned long width;
+  unsigned long height;
+  unsigned long size;
+  PVR2DERROR err;
+
+  if (drawable->rotated)
+    return True;
+
+  WSEGLDRI2RenderSize(drawable, &width, &height);
+  drawable->rotated_stride = (width + 0x1F) & ~0x1Fu;
+  size = drawable->rotated_stride * bpp[drawable->pixel_format] * height;
+  err = PVR2DMemAlloc(drawable->display->pvr_context, size, 4096, 0,
+                      &drawable->rotated);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_MEM_ALLOC, err,
+                             drawable->nativePixmap, size, drawable->rotated);
+  }
+
+  if (err)
+  {
+    drawable->rotated = NULL;
+    return False;
+  }
+
+  memset(drawable->presented, 0, sizeof(drawable->presented));
+
+  return True;
+}
+
+static void
+WSEGLDRI2FreeRotated(wsegldri2_drawable *drawable)
+{
+  if (!drawable->rotated)
+    return;
+
+  PVR2DQueryBlitsComplete(drawable->display->pvr_context, drawable->rotated,
+                          PVR2D_TRUE);
+  PVR2DMemFree(drawable->display->pvr_context, drawable->rotated);
+  drawable->rotated = NULL;
+}
+
+/*
+ * Turns what the GPU rendered back the way the window shows it. Doesn't wait
+ * for the blit, the caller does before anything reads dst.
+ */
+static PVR2DERROR
+WSEGLDRI2BltUnrotated(wsegldri2_drawable *drawable, PVR2DMEMINFO *dst,
+                      long dst_stride)
+{
+  wsegldri2_display *display = drawable->display;
+  PVR2DFORMAT format = pvr2d_format[drawable->pixel_format];
+  unsigned long width;
+  unsigned long height;
+  PVR2DBLTINFO blt;
+
+  WSEGLDRI2RenderSize(drawable, &width, &height);
+
+  memset(&blt, 0, sizeof(blt));
+  blt.CopyCode = PVR2DROPcopy;
+
+  switch (drawable->rotation)
+  {
+    case WSEGL_ROTATE_90:
+      blt.BlitFlags = PVR2D_BLIT_ROT_270;
+      break;
+    case WSEGL_ROTATE_180:
+      blt.BlitFlags = PVR2D_BLIT_ROT_180;
+      break;
+    case WSEGL_ROTATE_270:
+      blt.BlitFlags = PVR2D_BLIT_ROT_90;
+      break;
+    default:
+      blt.BlitFlags = PVR2D_BLIT_DISABLE_ALL;
+      break;
+  }
+
+  blt.pSrcMemInfo = drawable->pvr_meminfo;
+  blt.SrcStride = drawable->stride * bpp[drawable->pixel_format];
+  blt.SrcFormat = format;
+  blt.SrcSurfWidth = width;
+  blt.SrcSurfHeight = height;
+  blt.SizeX = width;
+  blt.SizeY = height;
+  blt.pDstMemInfo = dst;
+  blt.DstStride = dst_stride;
+  blt.DstFormat = format;
+  blt.DstSurfWidth = drawable->width;
+  blt.DstSurfHeight = drawable->height;
+  blt.DSizeX = drawable->width;
+  blt.DSizeY = drawable->height;
+
+  return WSEGLDRI2Blt(display->pvr_context, &blt, drawable->nativePixmap);
+}
+
+static void
+WSEGLDRI2ReleaseBuffer(wsegldri2_drawable *drawable)
+{
+  /* The flip chain owns its buffers */
+  if (drawable->flip_chain)
+    WSEGLDRI2DestroyFlipChain(drawable);
+  else if (drawable->shm)
+  {
+    pthread_mutex_lock(&drawable->display->lock);
+    WSEGLDRI2ReleaseShm(drawable->display, drawable->shm);
+    pthread_mutex_unlock(&drawable->display->lock);
+  }
+  else if (drawable->unrotated)
+    PVR2DMemFree(drawable->display->pvr_context, drawable->unrotated);
+  else if (drawable->pvr_meminfo)
+    PVR2DMemFree(drawable->display->pvr_context, drawable->pvr_meminfo);
+
+  drawable->shm = NULL;
+  drawable->pvr_meminfo = NULL;
+  drawable->unrotated = NULL;
+}
+
+/* Must be called with the drawables lock held */
+static wsegldri2_drawable *
+WSEGLDRI2FindDrawable(wsegldri2_display *display, XID xid)
+{
+  wsegldri2_drawable *drawable;
+
+  for (drawable = display->drawables; drawable; drawable = drawable->next)
+  {
+    if (drawable->nativePixmap == xid)
+      return drawable;
+  }
+
+  return NULL;
+}
+
+static
+WSEGLError WSEGLDRI2DeleteDrawable(WSEGLDrawableHandle handle)
+{
+  wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
+  wsegldri2_drawable **link;
+  unsigned long long trace_start;
+  LOG();
+
+  TRACE_BEGIN(trace_start);
+  pthread_mutex_lock(&drawable->display->drawables_lock);
+
+  for (link = &drawable->display->drawables; *link; link = &(*link)->next)
+  {
+    if (*link == drawable)
+    {
+      *link = drawable->next;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&drawable->display->drawables_lock);
+
+  /* Wait for a copy into it that found it before it was unlinked */
+  pthread_mutex_lock(&drawable->lock);
+  pthread_mutex_unlock(&drawable->lock);
+  pthread_mutex_destroy(&drawable->lock);
+
+  DRI2DiscardReply(drawable->display->dpy, drawable->buffers_cookie);
+  DRI2DiscardReply(drawable->display->dpy, drawable->swap_cookie);
+  DRI2DestroyDrawable(drawable->display->dpy, drawable->nativePixmap);
+
+  WSEGLDRI2ReleaseBuffer(drawable);
+  WSEGLDRI2FreeRotated(drawable);
+
+  TRACE_END("DeleteDrawable", trace_start, drawable->nativePixmap,
+            drawable->name);
+
+  free(drawable->damage);
+  free(drawable);
+
+  return WSEGL_SUCCESS;
+}
+
+/*
+ * Buffers are told apart by their DRI2 name, or position in the flip chain.
+ * The buffer a rotated drawable renders into shares -1 with the framebuffer,
+ * presented ages are reset when switching between the two.
+ */
+static int
+WSEGLDRI2BackBufferKey(wsegldri2_drawable *drawable)
+{
+  if (drawable->flip_chain)
+    return -2 - (int)drawable->flip_back;
+
+  /* Only ever the one, whatever the server hands out */
+  if (drawable->rotated && drawable->pvr_meminfo == drawable->rotated)
+    return -1;
+
+  return drawable->name;
+}
+
+static void
+WSEGLDRI2UpdateBufferAge(wsegldri2_drawable *drawable)
+{
+  int key = WSEGLDRI2BackBufferKey(drawable);
+  int age = 0;
+  int i;
+
+  for (i = 0; i < ARRAY_SIZE(drawable->presented); i++)
+  {
+    if (drawable->presented[i].frame && drawable->presented[i].key == key)
+    {
+      age = drawable->frames + 1 - drawable->presented[i].frame;
+      break;
+    }
+  }
+
+  drawable->buffer_age = age;
+}
+
+/* The back buffer is about to be presented, remember which frame it holds */
+static void
+WSEGLDRI2PresentBuffer(wsegldri2_drawable *drawable)
+{
+  int key = WSEGLDRI2BackBufferKey(drawable);
+  int oldest = 0;
+  int i;
+
+  drawable->frames++;
+
+  for (i = 0; i < ARRAY_SIZE(drawable->presented); i++)
+  {
+    if (drawable->presented[i].key == key)
+    {
+      oldest = i;
+      break;
+    }
+
+    if (drawable->presented[i].frame < drawable->presented[oldest].frame)
+      oldest = i;
+  }
+
+  drawable->presented[oldest].key = key;
+  drawable->presented[oldest].frame = drawable->frames;
+}
+
+/* Widen the swap count of the last BufferSwapComplete event to 64 bits */
+static void
+WSEGLDRI2UpdateCompleteSbc(wsegldri2_drawable *drawable)
+{
+  CARD64 sbc = drawable->event_sbc;
+
+  sbc |= drawable->complete_sbc & ~(CARD64)0xffffffff;
+
+  if (sbc < drawable->complete_sbc)
+    sbc += (CARD64)1 << 32;
+
+  if (sbc > drawable->complete_sbc && sbc <= drawable->swap_sbc)
+    drawable->complete_sbc = sbc;
+}
+
+static void
+WSEGLDRI2ThrottleSwaps(wsegldri2_drawable *drawable)
+{
+  Display *dpy = drawable->display->dpy;
+  unsigned int max = drawable->display->frames_in_flight;
+  CARD64 ust, msc, sbc;
+
+  /*
+   * Asked to be double buffered, the previous frame has to be on screen
+   * first whatever WSEGL_FramesInFlight says.
+   */
+  if (drawable->back_buffers_set && max > drawable->back_buffers)
+    max = drawable->back_buffers;
+
+  if (!drawable->sbc_valid)
+  {
+    STAT_ADD(round_trips, 1);
+
+    if (!DRI2GetMSC(dpy, drawable->nativePixmap, &ust, &msc, &sbc))
+      sbc = 0;
+
+    drawable->swap_sbc = sbc;
+    drawable->complete_sbc = sbc;
+    drawable->event_sbc = sbc;
+    drawable->sbc_valid = WSEGL_TRUE;
+    return;
+  }
+
+  WSEGLDRI2UpdateCompleteSbc(drawable);
+
+  if (drawable->swap_sbc - drawable->complete_sbc < max)
+    return;
+
+  /* Pick up any BufferSwapComplete events that are already on the wire */
+  XEventsQueued(dpy, QueuedAfterReading);
+  WSEGLDRI2UpdateCompleteSbc(drawable);
+
+  if (drawable->swap_sbc - drawable->complete_sbc < max)
+    return;
+
+  STAT_ADD(round_trips, 1);
+
+  if (DRI2WaitSBC(dpy, drawable->nativePixmap, drawable->swap_sbc - max + 1,
+                  &ust, &msc, &sbc) && sbc > drawable->complete_sbc)
+  {
+    drawable->complete_sbc = sbc;
+  }
 }
 
-static void
-WSEGLDRI2FreeSharedMemory(wsegldri2_drawable *drawable)
+static WSEGLError
+WSEGLDRI2SwapDrawable(WSEGLDrawableHandle handle, unsigned long data)
 {
-  PVR2DQueryBlitsComplete(
-        drawable->display->pvr_context, drawable->pvr_meminfo, PVR2D_TRUE);
-  PVR2DMemFree(drawable->display->pvr_context, drawable->pvr_meminfo);
-  shmdt(drawable->shmaddr);
+  wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
+  LOG();
+
+  XserverRegion region;
+  XRectangle rectangle;
+  XRectangle *damage;
+  int num_damage;
+  unsigned long long trace_start;
+  unsigned long long trace_swap;
+  Bool unrotate_pending = False;
+
+  TRACE_BEGIN(trace_start);
+  pthread_mutex_lock(&drawable->lock);
+
+  pthread_mutex_lock(&drawable->display->drawables_lock);
+  damage = drawable->damage;
+  num_damage = drawable->num_damage;
+  drawable->damage = NULL;
+  drawable->num_damage = 0;
+  pthread_mutex_unlock(&drawable->display->drawables_lock);
+
+  WSEGLDRI2PresentBuffer(drawable);
+
+  /* Fullscreen, the server isn't involved at all */
+  if (drawable->flip_chain)
+  {
+    PVR2DERROR err;
+
+    TRACE_BEGIN(trace_swap);
+    err = PVR2DPresentFlip(drawable->display->pvr_context,
+                           drawable->flip_chain, drawable->pvr_meminfo, 0);
+    TRACE_END("PresentFlip", trace_swap, drawable->nativePixmap,
+              drawable->name);
+
+    if (record_file)
+    {
+      WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_PRESENT_FLIP, err,
+                               drawable->flip_back, 0, drawable->pvr_meminfo);
+    }
+
+    drawable->flip_presented = True;
+    drawable->flip_back = (drawable->flip_back + 1) %
+                          drawable->num_flip_buffers;
+    drawable->pvr_meminfo = drawable->flip_buffers[drawable->flip_back];
+    WSEGLDRI2UpdateBufferAge(drawable);
+
+    /* Look for the window being obscured or resized */
+    if (drawable->display->dri2_minor < 3)
+      drawable->buffers_valid = WSEGL_FALSE;
+
+    goto out;
+  }
+
+  /*
+   * The server only ever sees the frame the way the window shows it. The
+   * blit runs while we wait for the server, it is only waited for right
+   * before the server is told to read the buffer.
+   */
+  if (drawable->rotated && drawable->pvr_meminfo == drawable->rotated)
+  {
+    TRACE_BEGIN(trace_swap);
+    unrotate_pending = !WSEGLDRI2BltUnrotated(drawable, drawable->unrotated,
+                                              drawable->unrotated_pitch);
+    TRACE_END("PVR2DBlt", trace_swap, drawable->nativePixmap, drawable->name);
+  }
+
+  /*
+   * Partial swaps rely on the back buffer being preserved, which a buffer
+   * exchanging SwapBuffers doesn't guarantee, so they still go through
+   * CopyRegion.
+   */
+  if (drawable->display->frames_in_flight && !num_damage &&
+      drawable->drawable_type == WSEGL_DRAWABLE_WINDOW)
+  {
+    unsigned int cookie;
+
+    WSEGLDRI2ThrottleSwaps(drawable);
+
+    if (unrotate_pending)
+    {
+      PVR2DQueryBlitsComplete(drawable->display->pvr_context,
+                              drawable->unrotated, PVR2D_TRUE);
+      unrotate_pending = False;
+    }
+
+    TRACE_BEGIN(trace_swap);
+    cookie = DRI2SwapBuffersRequest(drawable->display->dpy,
+                                    drawable->nativePixmap, 0, 0, 0);
+
+    if (cookie)
+    {
+      TRACE_END("DRI2SwapBuffers", trace_swap, drawable->nativePixmap,
+                drawable->name);
+      drawable->swap_sbc++;
+
+      /* A later reply orders the events of the earlier swaps as well */
+      DRI2DiscardReply(drawable->display->dpy, drawable->swap_cookie);
+      drawable->swap_cookie = cookie;
+
+      /* The server may exchange buffers, the age is known once looked up */
+      drawable->buffer_age = 0;
+
+      if (drawable->display->dri2_minor < 3)
+        drawable->buffers_valid = WSEGL_FALSE;
+
+      goto out;
+    }
+  }
+
+  if (num_damage)
+    region = XFixesCreateRegion(drawable->display->dpy, damage, num_damage);
+  else
+  {
+    rectangle.width = drawable->width;
+    rectangle.height = drawable->height;
+    rectangle.x = 0;
+    rectangle.y = 0;
+    region = XFixesCreateRegion(drawable->display->dpy, &rectangle, 1);
+  }
+
+  /* CopyRegion isn't scheduled by the server, wait for the vblank here */
+  if (drawable->swap_interval && drawable->display->dri2_minor >= 2)
+  {
+    CARD64 ust, msc, sbc;
+
+    STAT_ADD(round_trips, 1);
+
+    if (DRI2WaitMSC(drawable->display->dpy, drawable->nativePixmap,
+                    drawable->last_msc + drawable->swap_interval, 0, 0,
+                    &ust, &msc, &sbc))
+    {
+      drawable->last_msc = msc;
+    }
+  }
+
+  if (unrotate_pending)
+  {
+    PVR2DQueryBlitsComplete(drawable->display->pvr_context,
+                            drawable->unrotated, PVR2D_TRUE);
+  }
+
+  /* CopyRegion waits for its reply */
+  STAT_ADD(round_trips, 1);
+  TRACE_BEGIN(trace_swap);
+  DRI2CopyRegion(drawable->display->dpy, drawable->nativePixmap, region, 0, 1);
+  TRACE_END("DRI2CopyRegion", trace_swap, drawable->nativePixmap,
+            drawable->name);
+  XFixesDestroyRegion(drawable->display->dpy, region);
+
+  /* Copied, the back buffer keeps the frame */
+  WSEGLDRI2UpdateBufferAge(drawable);
+
+  /* Without invalidate events, look the buffers up again on the next frame */
+  if (drawable->display->dri2_minor < 3)
+    drawable->buffers_valid = WSEGL_FALSE;
+
+out:
+  TRACE_END("SwapDrawable", trace_start, drawable->nativePixmap,
+            drawable->name);
+  pthread_mutex_unlock(&drawable->lock);
+  free(damage);
+
+  return WSEGL_SUCCESS;
 }
 
-static
-WSEGLError WSEGLDRI2DeleteDrawable(WSEGLDrawableHandle handle)
+static WSEGLError
+WSEGLDRI2SwapControlInterval(WSEGLDrawableHandle handle, unsigned long interval)
 {
   wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
   LOG();
 
-  DRI2DestroyDrawable(drawable->display->dpy, drawable->nativePixmap);
+  if (drawable->drawable_type != WSEGL_DRAWABLE_WINDOW)
+    return WSEGL_SUCCESS;
 
-  if (drawable->pvr_meminfo)
-    WSEGLDRI2FreeSharedMemory(drawable);
+  if (interval > max_swap_interval)
+    interval = max_swap_interval;
 
-  free(drawable);
+  pthread_mutex_lock(&drawable->lock);
+
+  /* Before DRI2 1.2 only flips can be paced */
+  if (drawable->swap_interval != interval)
+  {
+    drawable->swap_interval = interval;
+
+    if (drawable->display->dri2_minor >= 2)
+    {
+      DRI2SwapInterval(drawable->display->dpy, drawable->nativePixmap,
+                       interval);
+    }
+
+    if (drawable->flip_chain)
+      WSEGLDRI2SetFlipInterval(drawable);
+  }
+
+  pthread_mutex_unlock(&drawable->lock);
 
   return WSEGL_SUCCESS;
 }
 
 static WSEGLError
-WSEGLDRI2SwapDrawable(WSEGLDrawableHandle handle, unsigned long data)
+WSEGLDRI2WaitNative(WSEGLDrawableHandle handle, unsigned long engine)
 {
   wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
+  Display *dpy = drawable->display->dpy;
+  unsigned long long trace_start;
   LOG();
 
-  XserverRegion region;
-  XRectangle rectangle;
+  if (engine != WSEGL_DEFAULT_NATIVE_ENGINE)
+    return WSEGL_BAD_NATIVE_ENGINE;
 
-  rectangle.width = drawable->width;
-  rectangle.height = drawable->height;
-  rectangle.x = 0;
-  rectangle.y = 0;
-  region = XFixesCreateRegion(drawable->display->dpy, &rectangle, 1);
+  TRACE_BEGIN(trace_start);
 
-  DRI2CopyRegion(drawable->display->dpy, drawable->nativePixmap, region, 0, 1);
-  XFixesDestroyRegion(drawable->display->dpy, region);
-  drawable->is_pixmap = False;
+  /*
+   * The server renders in request order, so once a reply or an event for the
+   * last request we sent has come back, everything before it is done too.
+   * Only pay for a round trip when there are requests still in flight.
+   */
+  if (XNextRequest(dpy) - 1 != XLastKnownRequestProcessed(dpy))
+  {
+    XSync(dpy, False);
+    STAT_ADD(round_trips, 1);
+  }
+
+  TRACE_END("WaitNative", trace_start, drawable->nativePixmap, drawable->name);
+
+  return WSEGL_SUCCESS;
+}
+
+static void
+WSEGLDRI2InitImage(XImage *image, WSEGLPixelFormat format, unsigned int depth,
+                   unsigned long width, unsigned long height,
+                   int bytes_per_line, char *data)
+{
+  int bits_per_pixel = 8 * bpp[format];
+
+  memset(image, 0, sizeof(*image));
+
+  switch (format)
+  {
+    case WSEGL_PIXELFORMAT_4444:
+    {
+      image->red_mask = 0xF00;
+      image->green_mask = 0xF0;
+      image->blue_mask = 0xF;
+      break;
+    }
+    case WSEGL_PIXELFORMAT_1555:
+    {
+      image->red_mask = 0x7C00;
+      image->green_mask = 0x3E0;
+      image->blue_mask = 0x1F;
+      break;
+    }
+    case WSEGL_PIXELFORMAT_8888:
+    {
+      image->red_mask = 0xFF0000;
+      image->green_mask = 0xFF00;
+      image->blue_mask = 0xFF;
+      break;
+    }
+    default:
+    {
+      image->red_mask = 0xF800;
+      image->green_mask = 0x7E0;
+      image->blue_mask = 0x1F;
+      break;
+    }
+  }
+
+  image->width = width;
+  image->height = height;
+  image->format = ZPixmap;
+  image->bytes_per_line = bytes_per_line;
+  image->data = data;
+  image->bitmap_pad = bits_per_pixel;
+  image->depth = depth;
+  image->bits_per_pixel = bits_per_pixel;
+  image->bitmap_unit = bits_per_pixel;
+
+  XInitImage(image);
+}
+
+/* The format of the image data a pixmap of the given depth takes */
+static int
+WSEGLDRI2DepthFormat(unsigned int depth)
+{
+  switch (depth)
+  {
+    case 15:
+      return WSEGL_PIXELFORMAT_1555;
+    case 16:
+      return WSEGL_PIXELFORMAT_565;
+    case 24:
+    case 32:
+      return WSEGL_PIXELFORMAT_8888;
+    default:
+      return -1;
+  }
+}
+
+static Bool
+WSEGLDRI2GetPixmapDepth(wsegldri2_display *display, Drawable pixmap,
+                        unsigned int *depth)
+{
+  Window window;
+  int tmp1;
+  unsigned int tmp2;
+
+  STAT_ADD(round_trips, 1);
+
+  return XGetGeometry(display->dpy, pixmap, &window, &tmp1, &tmp1, &tmp2,
+                      &tmp2, &tmp2, depth);
+}
+
+/* Get size bytes for image data, shared with the server if possible */
+static char *
+WSEGLDRI2GetImageBuffer(wsegldri2_display *display, unsigned long size,
+                        wsegldri2_staging **staging)
+{
+  if (display->has_shm && (*staging = WSEGLDRI2GetStaging(display, size)))
+    return (*staging)->info.shmaddr;
+
+  *staging = NULL;
+
+  if (display->image_buf_size < size)
+  {
+    char *image_buf = (char *)realloc(display->image_buf, size);
+
+    STAT_ADD(allocations, 1);
+
+    if (!image_buf)
+      return NULL;
+
+    display->image_buf = image_buf;
+    display->image_buf_size = size;
+  }
+
+  return display->image_buf;
+}
+
+static void
+WSEGLDRI2PutImage(wsegldri2_display *display, Drawable drawable,
+                  XImage *image, XShmSegmentInfo *shminfo)
+{
+  GC gc;
+  GC tmp_gc = NULL;
+
+  gc = WSEGLDRI2GetGC(display, drawable, image->depth);
+
+  if (!gc)
+    gc = tmp_gc = XCreateGC(display->dpy, drawable, 0, 0);
+
+  if (shminfo)
+  {
+    image->obdata = (char *)shminfo;
+    XShmPutImage(display->dpy, drawable, gc, image, 0, 0, 0, 0,
+                 image->width, image->height, False);
+
+    /* The server reads the pixels when it gets there, wait for it */
+    XSync(display->dpy, False);
+    STAT_ADD(round_trips, 1);
+  }
+  else
+  {
+    XPutImage(display->dpy, drawable, gc, image, 0, 0, 0, 0,
+              image->width, image->height);
+  }
+
+  if (tmp_gc)
+    XFreeGC(display->dpy, tmp_gc);
+
+  /* Bottom-up images have a negative bytes_per_line */
+  STAT_ADD(bytes_copied, image->height * abs(image->bytes_per_line));
+}
+
+/*
+ * Copy width x height pixels, converting them from src_format to dst_format.
+ * Bottom-up sources are flipped by passing their last row and a negative
+ * src_bytes_per_line.
+ */
+static Bool
+WSEGLDRI2CopyRows(char *dst, int dst_bytes_per_line, int dst_format,
+                  const char *src, int src_bytes_per_line, int src_format,
+                  unsigned long width, unsigned long height)
+{
+  void (*convert)(char *, const char *, unsigned long) = NULL;
+
+  if (dst_format != src_format)
+  {
+    if (dst_format == WSEGL_PIXELFORMAT_8888)
+    {
+      switch (src_format)
+      {
+        case WSEGL_PIXELFORMAT_565:
+          convert = WSEGLDRI2Convert565To8888;
+          break;
+        case WSEGL_PIXELFORMAT_4444:
+          convert = WSEGLDRI2Convert4444To8888;
+          break;
+        case WSEGL_PIXELFORMAT_1555:
+          convert = WSEGLDRI2Convert1555To8888;
+          break;
+      }
+    }
+    else if (dst_format == WSEGL_PIXELFORMAT_565 &&
+             src_format == WSEGL_PIXELFORMAT_8888)
+    {
+      convert = WSEGLDRI2Convert8888To565;
+    }
+
+    if (!convert)
+      return False;
+  }
+
+  while (height--)
+  {
+    if (convert)
+      convert(dst, src, width);
+    else
+      memcpy(dst, src, width * bpp[src_format]);
+
+    dst += dst_bytes_per_line;
+    src += src_bytes_per_line;
+  }
+
+  return True;
+}
+
+/* Copy with the 2D core into a staging buffer, to send it with MIT-SHM */
+static Bool
+WSEGLDRI2BltToStaging(wsegldri2_display *display, wsegldri2_staging *staging,
+                      PVR2DMEMINFO *src, int bytes_per_line, int format,
+                      unsigned long width, unsigned long height)
+{
+  unsigned long long trace_start;
+  PVR2DBLTINFO blt;
+  PVR2DERROR err;
+
+  /* Only wrapped once the GPU copies into it, CPU copies don't need it */
+  if (!staging->pvr_meminfo)
+  {
+    if (staging->wrap_failed)
+      return False;
+
+    STAT_ADD(mem_wraps, 1);
+    err = PVR2DMemWrap(display->pvr_context, staging->info.shmaddr,
+                       staging->size == (unsigned long)getpagesize(),
+                       staging->size, NULL, &staging->pvr_meminfo);
+
+    if (record_file)
+    {
+      WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_STAGING_WRAP, err,
+                               staging->info.shmid, staging->size,
+                               staging->pvr_meminfo);
+    }
+
+    if (err)
+    {
+      staging->pvr_meminfo = NULL;
+      staging->wrap_failed = True;
+      return False;
+    }
+  }
+
+  memset(&blt, 0, sizeof(blt));
+  blt.CopyCode = PVR2DROPcopy;
+  blt.BlitFlags = PVR2D_BLIT_DISABLE_ALL;
+  blt.pSrcMemInfo = src;
+  blt.SrcStride = bytes_per_line;
+  blt.SrcFormat = pvr2d_format[format];
+  blt.SrcSurfWidth = width;
+  blt.SrcSurfHeight = height;
+  blt.SizeX = width;
+  blt.SizeY = height;
+  blt.pDstMemInfo = staging->pvr_meminfo;
+  blt.DstStride = bytes_per_line;
+  blt.DstFormat = pvr2d_format[format];
+  blt.DstSurfWidth = width;
+  blt.DstSurfHeight = height;
+  blt.DSizeX = width;
+  blt.DSizeY = height;
+
+  TRACE_BEGIN(trace_start);
+  err = WSEGLDRI2Blt(display->pvr_context, &blt, 0);
+
+  if (!err)
+    err = PVR2DQueryBlitsComplete(display->pvr_context, staging->pvr_meminfo,
+                                  PVR2D_TRUE);
+
+  TRACE_END("PVR2DBlt", trace_start, 0, 0);
+
+  return err == PVR2D_OK;
+}
+
+/*
+ * Send width x height pixels to a pixmap. The image is converted to the
+ * pixmap's format and flipped into a staging buffer when needed.
+ */
+static WSEGLError
+WSEGLDRI2CopyToPixmap(wsegldri2_display *display, NativePixmapType pixmap,
+                      const char *src, int bytes_per_line, int format,
+                      unsigned long width, unsigned long height,
+                      wsegldri2_shm *src_shm, PVR2DMEMINFO *src_meminfo)
+{
+  XImage image;
+  XShmSegmentInfo shminfo;
+  wsegldri2_staging *staging;
+  unsigned int depth;
+  int dst_format;
+  int dst_bytes_per_line;
+  char *dst;
+
+  if (!WSEGLDRI2GetPixmapDepth(display, pixmap, &depth))
+    return WSEGL_BAD_NATIVE_PIXMAP;
+
+  dst_format = WSEGLDRI2DepthFormat(depth);
+
+  if (dst_format < 0)
+    return WSEGL_BAD_CONFIG;
+
+  if (dst_format == format && bytes_per_line > 0)
+  {
+    WSEGLDRI2InitImage(&image, format, depth, width, height, bytes_per_line,
+                       (char *)src);
+
+    /* Server shm buffers can be handed back to it without any copy */
+    if (src_shm && display->has_shm && WSEGLDRI2AttachShm(display, src_shm))
+    {
+      shminfo.shmseg = src_shm->shmseg;
+      shminfo.shmid = src_shm->name;
+      shminfo.shmaddr = src_shm->shmaddr;
+      shminfo.readOnly = True;
+      WSEGLDRI2PutImage(display, pixmap, &image, &shminfo);
+
+      return WSEGL_SUCCESS;
+    }
+
+    /* Buffers we can't share, the framebuffer say, the GPU copies out */
+    if (src_meminfo && display->has_shm &&
+        (staging = WSEGLDRI2GetStaging(display, height * bytes_per_line)))
+    {
+      if (WSEGLDRI2BltToStaging(display, staging, src_meminfo,
+                                bytes_per_line, format, width, height))
+      {
+        image.data = staging->info.shmaddr;
+        WSEGLDRI2PutImage(display, pixmap, &image, &staging->info);
+        WSEGLDRI2PutStaging(display, staging);
+
+        return WSEGL_SUCCESS;
+      }
+
+      WSEGLDRI2PutStaging(display, staging);
+    }
+
+    WSEGLDRI2PutImage(display, pixmap, &image, NULL);
+
+    return WSEGL_SUCCESS;
+  }
+
+  /*
+   * Without MIT-SHM Xlib copies the rows into the request anyway and walks
+   * them bottom-up just as fast, flipping them here first only adds a copy.
+   */
+  dst_bytes_per_line = (width * bpp[dst_format] + 3) & ~3;
+  dst = NULL;
+
+  if (dst_format != format || display->has_shm)
+  {
+    dst = WSEGLDRI2GetImageBuffer(display, height * dst_bytes_per_line,
+                                  &staging);
+  }
+
+  if (dst)
+  {
+    if (!WSEGLDRI2CopyRows(dst, dst_bytes_per_line, dst_format, src,
+                           bytes_per_line, format, width, height))
+    {
+      if (staging)
+        WSEGLDRI2PutStaging(display, staging);
+
+      return WSEGL_BAD_CONFIG;
+    }
+
+    WSEGLDRI2InitImage(&image, dst_format, depth, width, height,
+                       dst_bytes_per_line, dst);
+    WSEGLDRI2PutImage(display, pixmap, &image,
+                      staging ? &staging->info : NULL);
+
+    if (staging)
+      WSEGLDRI2PutStaging(display, staging);
+
+    return WSEGL_SUCCESS;
+  }
+
+  if (dst_format != format)
+    return WSEGL_OUT_OF_MEMORY;
+
+  /* Have Xlib walk the rows backwards as it builds the request */
+  WSEGLDRI2InitImage(&image, format, depth, width, height, -bytes_per_line,
+                     (char *)src);
+  image.bytes_per_line = bytes_per_line;
+  WSEGLDRI2PutImage(display, pixmap, &image, NULL);
+
+  return WSEGL_SUCCESS;
+}
+
+/*
+ * Find a pixmap we have a buffer wrapped for. Tries its lock only, the
+ * caller already holds the lock of the source and may be copying the
+ * other way round on another thread.
+ */
+static wsegldri2_drawable *
+WSEGLDRI2TryLockPixmap(wsegldri2_display *display, Pixmap pixmap)
+{
+  wsegldri2_drawable *drawable;
+
+  pthread_mutex_lock(&display->drawables_lock);
+  drawable = WSEGLDRI2FindDrawable(display, pixmap);
+
+  if (drawable && (drawable->drawable_type != WSEGL_DRAWABLE_PIXMAP ||
+                   pthread_mutex_trylock(&drawable->lock)))
+  {
+    drawable = NULL;
+  }
+
+  pthread_mutex_unlock(&display->drawables_lock);
+
+  return drawable;
+}
+
+/* Copy with the 2D core straight into the buffer backing the pixmap */
+static Bool
+WSEGLDRI2BltToPixmap(wsegldri2_drawable *src, wsegldri2_drawable *dst)
+{
+  wsegldri2_display *display = src->display;
+  PVR2DFORMAT format = pvr2d_format[src->pixel_format];
+  unsigned long long trace_start;
+  PVR2DBLTINFO blt;
+  PVR2DERROR err;
+
+  if (!dst->pvr_meminfo || !dst->buffers_valid ||
+      dst->buffers_serial != dst->invalidate_serial ||
+      dst->pixel_format != src->pixel_format)
+  {
+    return False;
+  }
 
-  return WSEGL_SUCCESS;
+  memset(&blt, 0, sizeof(blt));
+  blt.CopyCode = PVR2DROPcopy;
+  blt.BlitFlags = PVR2D_BLIT_DISABLE_ALL;
+  blt.pSrcMemInfo = src->pvr_meminfo;
+  blt.SrcStride = src->stride * bpp[src->pixel_format];
+  blt.SrcFormat = format;
+  blt.SrcSurfWidth = src->width;
+  blt.SrcSurfHeight = src->height;
+  blt.SizeX = src->width < dst->width ? src->width : dst->width;
+  blt.SizeY = src->height < dst->height ? src->height : dst->height;
+  blt.pDstMemInfo = dst->pvr_meminfo;
+  blt.DstStride = dst->stride * bpp[dst->pixel_format];
+  blt.DstFormat = format;
+  blt.DstSurfWidth = dst->width;
+  blt.DstSurfHeight = dst->height;
+  blt.DSizeX = blt.SizeX;
+  blt.DSizeY = blt.SizeY;
+
+  TRACE_BEGIN(trace_start);
+  err = WSEGLDRI2Blt(display->pvr_context, &blt, dst->nativePixmap);
+
+  /* The server reads the pixmap as soon as it is told to */
+  if (!err)
+    err = PVR2DQueryBlitsComplete(display->pvr_context, dst->pvr_meminfo,
+                                  PVR2D_TRUE);
+
+  TRACE_END("PVR2DBlt", trace_start, dst->nativePixmap, dst->name);
+
+  return err == PVR2D_OK;
 }
 
+/* Turned back the way the window shows it, then copied as any other image */
 static WSEGLError
-WSEGLDRI2SwapControlInterval()
+WSEGLDRI2CopyRotatedToPixmap(wsegldri2_drawable *drawable,
+                             NativePixmapType nativePixmap)
 {
-  return WSEGL_SUCCESS;
-}
+  wsegldri2_display *display = drawable->display;
+  PVR2DMEMINFO *unrotated;
+  unsigned long bytes_per_line;
+  WSEGLError rv;
 
-static WSEGLError
-WSEGLDRI2WaitNative(WSEGLDrawableHandle handle, unsigned long engine)
-{
-  wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
-  LOG();
+  bytes_per_line = (drawable->width * bpp[drawable->pixel_format] + 3) & ~3u;
 
-  if (engine != WSEGL_DEFAULT_NATIVE_ENGINE)
-    return WSEGL_BAD_NATIVE_ENGINE;
+  if (PVR2DMemAlloc(display->pvr_context, bytes_per_line * drawable->height,
+                    4096, 0, &unrotated))
+  {
+    return WSEGL_OUT_OF_MEMORY;
+  }
+
+  if (WSEGLDRI2BltUnrotated(drawable, unrotated, bytes_per_line) ||
+      PVR2DQueryBlitsComplete(display->pvr_context, unrotated, PVR2D_TRUE))
+  {
+    rv = WSEGL_BAD_DRAWABLE;
+  }
+  else
+  {
+    pthread_mutex_lock(&display->lock);
+    rv = WSEGLDRI2CopyToPixmap(display, nativePixmap, unrotated->pBase,
+                               bytes_per_line, drawable->pixel_format,
+                               drawable->width, drawable->height, NULL,
+                               unrotated);
+    pthread_mutex_unlock(&display->lock);
+  }
 
-  XSync(drawable->display->dpy, 0);
+  PVR2DMemFree(display->pvr_context, unrotated);
 
-  return WSEGL_SUCCESS;
+  return rv;
 }
 
 static WSEGLError
@@ -453,78 +3142,86 @@ WSEGLDRI2CopyFromDrawable(WSEGLDrawableHandle handle,
 {
   wsegldri2_drawable *drawable = (wsegldri2_drawable *)handle;
   wsegldri2_display *display = drawable->display;
-  int bytes_per_pixel;
-  int bits_per_pixel;
-  unsigned int red_mask;
-  unsigned int green_mask;
-  unsigned int blue_mask;
-  GC gc;
-  XImage image;
-  Window window;
-  int tmp1;
-  unsigned int tmp2;
-  unsigned int depth;
+  wsegldri2_drawable *dst;
+  WSEGLError rv = WSEGL_BAD_DRAWABLE;
   LOG();
 
-  memset(&image, 0, sizeof(image));
-  bytes_per_pixel = bpp[drawable->pixel_format];
+  pthread_mutex_lock(&drawable->lock);
 
-  if (!XGetGeometry(display->dpy, nativePixmap, &window, &tmp1, &tmp1, &tmp2,
-                     &tmp2, &tmp2, &depth))
+  if (drawable->rotation != WSEGL_ROTATE_0)
   {
-    return WSEGL_BAD_CONFIG;
+    if (drawable->pvr_meminfo)
+      rv = WSEGLDRI2CopyRotatedToPixmap(drawable, nativePixmap);
+
+    pthread_mutex_unlock(&drawable->lock);
+    return rv;
   }
 
-  bits_per_pixel = 8 * bytes_per_pixel;
+  if (drawable->pvr_meminfo &&
+      (dst = WSEGLDRI2TryLockPixmap(display, (Pixmap)nativePixmap)))
+  {
+    if (WSEGLDRI2BltToPixmap(drawable, dst))
+      rv = WSEGL_SUCCESS;
 
-  if (bits_per_pixel != depth )
-    return WSEGL_BAD_CONFIG;
+    pthread_mutex_unlock(&dst->lock);
+  }
 
-  switch (drawable->pixel_format)
+  if (drawable->pvr_meminfo && rv != WSEGL_SUCCESS)
   {
-    case WSEGL_PIXELFORMAT_4444:
-    {
-      red_mask = 0xF00;
-      green_mask = 0xF0;
-      blue_mask = 0xF;
-      break;
-    }
-    case WSEGL_PIXELFORMAT_8888:
-    {
-      red_mask = 0xFF0000;
-      green_mask = 0xFF00;
-      blue_mask = 0xFF;
-      break;
-    }
-    default:
-    {
-      red_mask = 0xF800;
-      green_mask = 0x7E0;
-      blue_mask = 0x1F;
-      break;
-    }
+    pthread_mutex_lock(&display->lock);
+    rv = WSEGLDRI2CopyToPixmap(display, nativePixmap,
+                               drawable->pvr_meminfo->pBase,
+                               drawable->stride * bpp[drawable->pixel_format],
+                               drawable->pixel_format, drawable->width,
+                               drawable->height, drawable->shm,
+                               drawable->pvr_meminfo);
+    pthread_mutex_unlock(&display->lock);
+  }
+
+  pthread_mutex_unlock(&drawable->lock);
+
+  return rv;
+}
+
+/*
+ * Find and reference the display to copy a pbuffer to a pixmap on, since
+ * pbuffers have no drawable of their own: the display of a drawable on the
+ * pixmap, else the one the calling thread last created a drawable on, else
+ * the oldest. Pixmap XIDs are global to the server, so the fallbacks only
+ * have to reach the same server.
+ */
+static wsegldri2_display *
+WSEGLDRI2FindPixmapDisplay(NativePixmapType nativePixmap)
+{
+  wsegldri2_display *display;
+  wsegldri2_display *found = NULL;
+  wsegldri2_display *fallback = NULL;
+
+  pthread_mutex_lock(&display_lock);
+
+  for (display = displays; display && !found; display = display->next)
+  {
+    pthread_mutex_lock(&display->drawables_lock);
+
+    if (WSEGLDRI2FindDrawable(display, nativePixmap))
+      found = display;
+
+    pthread_mutex_unlock(&display->drawables_lock);
+
+    /* Displays are kept newest first, so this ends on the oldest */
+    if (!fallback || fallback != thread_display)
+      fallback = display;
   }
 
-  image.red_mask = red_mask;
-  image.green_mask = green_mask;
-  image.blue_mask = blue_mask;
-  image.width = drawable->width;
-  image.height = drawable->height;
-  image.format = ZPixmap;
-  image.bytes_per_line = drawable->stride * bpp[drawable->pixel_format];
-  image.data = (char *)drawable->pvr_meminfo;
-  image.bitmap_pad = bits_per_pixel;
-  image.depth = bits_per_pixel;
-  image.bits_per_pixel = bits_per_pixel;
-  image.bitmap_unit = bits_per_pixel;
+  if (!found)
+    found = fallback;
 
-  XInitImage(&image);
-  gc = XCreateGC(display->dpy, nativePixmap, 0, 0);
-  XPutImage(display->dpy, nativePixmap, gc, &image, 0, 0, 0, 0,
-            drawable->width, drawable->height);
-  XFreeGC(display->dpy, gc);
+  if (found)
+    WSEGLDRI2RefDisplay(found);
 
-  return WSEGL_SUCCESS;
+  pthread_mutex_unlock(&display_lock);
+
+  return found;
 }
 
 static WSEGLError
@@ -532,70 +3229,27 @@ WSEGLDRI2CopyFromPBuffer(void *address, unsigned long width,
                          unsigned long height, unsigned long stride,
                          WSEGLPixelFormat format, NativePixmapType nativePixmap)
 {
-  int bytes_per_pixel;
-  int bytes_per_line;
-  int bits_per_pixel;
-  GC gc;
-  unsigned long red_mask;
-  unsigned long green_mask;
-  unsigned long blue_mask;
-  XImage image;
+  int bytes_per_line = stride * bpp[format];
+  wsegldri2_display *display;
+  WSEGLError rv;
   LOG();
 
-  memset(&image, 0, sizeof(image));
-
-  bytes_per_pixel = bpp[format];
-  bytes_per_line = stride * bytes_per_pixel;
-  bits_per_pixel = 8 * bytes_per_pixel;
-
-  gc = XCreateGC(wsegl_display.dpy, nativePixmap, 0, 0);
-
-  switch (format)
-  {
-    case WSEGL_PIXELFORMAT_4444:
-    {
-      red_mask = 0xF00;
-      green_mask = 0xF0;
-      blue_mask = 0xF;
-      break;
-    }
-    case WSEGL_PIXELFORMAT_8888:
-    {
-      red_mask = 0xFF0000;
-      green_mask = 0xFF00;
-      blue_mask = 0xFF;
-      break;
-    }
-    default:
-    {
-      red_mask = 0xF800;
-      green_mask = 0x7E0;
-      blue_mask = 0x1F;
-      break;
-    }
-  }
+  display = WSEGLDRI2FindPixmapDisplay(nativePixmap);
 
-  image.red_mask = red_mask;
-  image.green_mask = green_mask;
-  image.blue_mask = blue_mask;
-  image.depth = bits_per_pixel;
-  image.bitmap_pad = bits_per_pixel;
-  image.bitmap_unit = bits_per_pixel;
-  image.bits_per_pixel = bits_per_pixel;
-  image.data = (char *)address + (height - 1) * bytes_per_line;
-  image.bytes_per_line = bytes_per_line;
-  image.width = width;
-  image.height = height;
-  image.format = ZPixmap;
-  XInitImage(&image);
+  if (!display)
+    return WSEGL_BAD_NATIVE_DISPLAY;
 
-  image.bytes_per_line = -image.bytes_per_line;
+  /* Pbuffers are bottom-up, start from the last row */
+  pthread_mutex_lock(&display->lock);
+  rv = WSEGLDRI2CopyToPixmap(display, nativePixmap,
+                             (char *)address + (height - 1) * bytes_per_line,
+                             -bytes_per_line, format, width, height, NULL,
+                             NULL);
+  pthread_mutex_unlock(&display->lock);
 
-  XPutImage(wsegl_display.dpy, nativePixmap, gc, &image, 0, 0, 0, 0,
-            width, height);
-  XFreeGC(wsegl_display.dpy, gc);
+  WSEGLDRI2CloseDisplay(display);
 
-  return WSEGL_SUCCESS;
+  return rv;
 }
 
 static WSEGLError
@@ -609,154 +3263,652 @@ WSEGLDRI2GetDrawableParameters(WSEGLDrawableHandle handle,
   WSEGLError rv;
   PVR2DMEMINFO *pvr_meminfo;
   unsigned long size;
-  unsigned int attachments[2];
+  unsigned int serial;
+  unsigned int cookie;
+  unsigned long long trace_start;
+  Bool resized;
   int outCount;
   int height;
   int width;
 
   LOG();
 
-  if (drawable->drawable_type == WSEGL_DRAWABLE_WINDOW)
+  pthread_mutex_lock(&drawable->lock);
+
+  /*
+   * A swap that exchanged buffers invalidates them, but nothing reads that
+   * event off the connection unless we do. The server sends it before the
+   * reply, so once the reply is in, have Xlib run the events through
+   * dri2InvalidateBuffers. The reply was sent when the swap was queued and
+   * usually is already waiting, but it is still a reply we block on.
+   */
+  if (drawable->swap_cookie)
   {
-    attachments[0] = WSEGL_DRAWABLE_WINDOW;
-    attachments[1] = 0;
-    count = 2;
+    CARD64 sbc;
+
+    STAT_ADD(round_trips, 1);
+    DRI2SwapBuffersReply(drawable->display->dpy, drawable->swap_cookie, &sbc);
+    drawable->swap_cookie = 0;
+    XEventsQueued(drawable->display->dpy, QueuedAfterReading);
+  }
+
+  /* An invalidate event may arrive on another thread at any time */
+  serial = drawable->invalidate_serial;
+
+  if (drawable->buffers_valid && drawable->buffers_serial == serial)
+    goto ok;
+
+  TRACE_BEGIN(trace_start);
+
+  if (drawable->buffers_cookie)
+  {
+    cookie = drawable->buffers_cookie;
+    serial = drawable->cookie_serial;
+    count = drawable->drawable_type == WSEGL_DRAWABLE_WINDOW ? 2 : 1;
+    drawable->buffers_cookie = 0;
   }
   else
   {
-    attachments[0] = 0;
-    count = 1;
+    STAT_ADD(round_trips, 1);
+    cookie = WSEGLDRI2RequestBuffers(drawable, &count);
+  }
+
+  buffer = DRI2GetBuffersReply(drawable->display->dpy, cookie, &width, &height,
+                               &outCount);
+  TRACE_END("DRI2GetBuffers", trace_start, drawable->nativePixmap,
+            buffer ? (int)buffer->name : 0);
+
+  if (record_file)
+  {
+    WSEGLDRI2RecordBuffersReply(drawable->nativePixmap, width, height, buffer,
+                                outCount, count);
   }
 
-  buffer = DRI2GetBuffers(drawable->display->dpy,
-                          drawable->nativePixmap,
-                          &width,
-                          &height,
-                          attachments,
-                          count,
-                          &outCount);
+  STAT_ADD(allocations, 1);
 
   if ( !buffer )
+  {
+    pthread_mutex_unlock(&drawable->lock);
     return WSEGL_OUT_OF_MEMORY;
+  }
 
-  if (drawable->is_pixmap)
+  if (outCount != count || width <= 0 || height <= 0)
   {
-    free(buffer);
-
-ok:
-    renderParams->ui32Width = drawable->width;
-    renderParams->ui32Height = drawable->height;
-    renderParams->ePixelFormat = drawable->pixel_format;
-    renderParams->ui32Stride = drawable->stride;
-    renderParams->pvLinearAddress = drawable->pvr_meminfo->pBase;
-    renderParams->ui32HWAddress = drawable->pvr_meminfo->ui32DevAddr;
-    renderParams->hPrivateData = drawable->pvr_meminfo->hPrivateData;
-
-    sourceParams->ui32Width = renderParams->ui32Width;
-    sourceParams->ui32Height = renderParams->ui32Height;
-    sourceParams->ui32Stride = renderParams->ui32Stride;
-    sourceParams->ePixelFormat = renderParams->ePixelFormat;
-    sourceParams->pvLinearAddress = renderParams->pvLinearAddress;
-    sourceParams->ui32HWAddress = renderParams->ui32HWAddress;
-    sourceParams->hPrivateData = renderParams->hPrivateData;
-
-    return WSEGL_SUCCESS;
+    rv = WSEGL_BAD_DRAWABLE;
+    goto err;
   }
 
-  if (outCount != count || width != drawable->width ||
-      height != drawable->height)
+  /*
+   * Older servers, and the framebuffer, may not give us the format we asked.
+   * A 16 bit window then renders in the 32 bit format of its visual.
+   */
+  if (buffer->cpp != bpp[drawable->pixel_format])
   {
-    free(buffer);
-    return WSEGL_BAD_DRAWABLE;
+    if (drawable->drawable_type != WSEGL_DRAWABLE_WINDOW ||
+        drawable->pixel_format != WSEGL_PIXELFORMAT_565 || buffer->cpp != 4)
+    {
+      rv = WSEGL_BAD_CONFIG;
+      goto err;
+    }
+
+    drawable->pixel_format = WSEGL_PIXELFORMAT_8888;
   }
 
-  pvr_meminfo = drawable->pvr_meminfo;
   drawable->stride = buffer->pitch/ buffer->cpp;
 
-  if ( !pvr_meminfo || drawable->name != buffer->name )
+  pvr_meminfo = drawable->pvr_meminfo;
+  resized = width != drawable->width || height != drawable->height;
+
+  if ( !pvr_meminfo || resized || drawable->name != buffer->name ||
+       (drawable->flip_chain &&
+        drawable->flip_length != WSEGLDRI2FlipChainLength(drawable)) )
   {
     size = buffer->pitch * height;
 
     if (!size)
     {
-      free(buffer);
-      return WSEGL_BAD_DRAWABLE;
+      rv = WSEGL_BAD_DRAWABLE;
+      goto err;
+    }
+
+    WSEGLDRI2ReleaseBuffer(drawable);
+    drawable->name = buffer->name;
+    /*
+     * The window was resized, follow it instead of failing the frame.
+     * Damage set for the old size is dropped, the next swap is a full one.
+     */
+    if (resized)
+    {
+      pthread_mutex_lock(&drawable->display->drawables_lock);
+      drawable->width = width;
+      drawable->height = height;
+      drawable->num_damage = 0;
+      pthread_mutex_unlock(&drawable->display->drawables_lock);
+
+      memset(drawable->presented, 0, sizeof(drawable->presented));
+      WSEGLDRI2FreeRotated(drawable);
     }
 
-    if ( drawable->name != -1 && pvr_meminfo )
+    if (buffer->name == -1 && WSEGLDRI2CreateFlipChain(drawable))
     {
-      WSEGLDRI2FreeSharedMemory(drawable);
-      drawable->shmaddr = NULL;
-      drawable->pvr_meminfo = NULL;
+      WSEGLDRI2FreeRotated(drawable);
+      drawable->pvr_meminfo = drawable->flip_buffers[drawable->flip_back];
     }
+    else if (buffer->name == -1)
+    {
+      PVR2DERROR err;
+      unsigned long render_width;
+      unsigned long render_height;
 
-    drawable->name = buffer->name;
+      err = PVR2DGetFrameBuffer(drawable->display->pvr_context, 0,
+                                &drawable->pvr_meminfo);
 
-    if (buffer->name == -1)
-    {
-      if (PVR2DGetFrameBuffer(drawable->display->pvr_context, 0,
-                              &drawable->pvr_meminfo))
+      if (record_file)
+      {
+        WSEGLDRI2RecordPVR2DCall(WSEGLDRI2_RECORD_GET_FRAME_BUFFER, err,
+                                 buffer->name, size, drawable->pvr_meminfo);
+      }
+
+      if (err)
       {
+        drawable->pvr_meminfo = NULL;
         rv = WSEGL_OUT_OF_MEMORY;
         goto err;
       }
-    }
-    else
-    {
-      unsigned long flags;
-      int pagesize;
 
-      drawable->shmaddr = shmat(buffer->name, 0, 0);
+      /*
+       * The framebuffer scans out the way the GPU renders a rotated drawable
+       * as long as it covers the whole of it. Otherwise render aside and turn
+       * every frame back into it, as with a server buffer.
+       */
+      WSEGLDRI2RenderSize(drawable, &render_width, &render_height);
 
-      if (!drawable->shmaddr)
+      if (drawable->rotation != WSEGL_ROTATE_0 &&
+          (render_width != drawable->display->fb_info.ulWidth ||
+           render_height != drawable->display->fb_info.ulHeight))
       {
-        free(buffer);
-        return WSEGL_OUT_OF_MEMORY;
-      }
+        drawable->unrotated = drawable->pvr_meminfo;
+        drawable->unrotated_pitch = drawable->display->fb_info.lStride;
 
-      pagesize = getpagesize();
-      flags = (size + pagesize - 1) / pagesize;
+        if (!WSEGLDRI2AllocRotated(drawable))
+        {
+          WSEGLDRI2ReleaseBuffer(drawable);
+          rv = WSEGL_OUT_OF_MEMORY;
+          goto err;
+        }
 
-      if (PVR2DMemWrap(drawable->display->pvr_context, drawable->shmaddr,
-                       flags == 1, size, NULL, &drawable->pvr_meminfo))
+        drawable->pvr_meminfo = drawable->rotated;
+      }
+      else if (drawable->rotated)
+      {
+        WSEGLDRI2FreeRotated(drawable);
+        memset(drawable->presented, 0, sizeof(drawable->presented));
+      }
+    }
+    else
+    {
+      TRACE_BEGIN(trace_start);
+      pthread_mutex_lock(&drawable->display->lock);
+      drawable->shm = WSEGLDRI2AcquireShm(drawable->display, buffer->name,
+                                          size);
+      pthread_mutex_unlock(&drawable->display->lock);
+      TRACE_END("WrapBuffer", trace_start, drawable->nativePixmap,
+                buffer->name);
+
+      if (!drawable->shm)
       {
-        drawable->pvr_meminfo = NULL;
         rv = WSEGL_OUT_OF_MEMORY;
         goto err;
       }
+
+      drawable->pvr_meminfo = drawable->shm->pvr_meminfo;
+
+      /*
+       * Not flipping, the GPU keeps rendering rotated into a buffer of our
+       * own which every swap turns back into the server's.
+       */
+      if (drawable->rotation != WSEGL_ROTATE_0)
+      {
+        drawable->unrotated = drawable->pvr_meminfo;
+        drawable->unrotated_pitch = buffer->pitch;
+
+        if (!WSEGLDRI2AllocRotated(drawable))
+        {
+          WSEGLDRI2ReleaseBuffer(drawable);
+          rv = WSEGL_OUT_OF_MEMORY;
+          goto err;
+        }
+
+        drawable->pvr_meminfo = drawable->rotated;
+      }
     }
   }
 
+  if (drawable->flip_chain)
+    drawable->stride = drawable->flip_stride / bpp[drawable->pixel_format];
+  else if (drawable->rotated && drawable->pvr_meminfo == drawable->rotated)
+    drawable->stride = drawable->rotated_stride;
+  else if (drawable->rotation != WSEGL_ROTATE_0)
+  {
+    drawable->stride = drawable->display->fb_info.lStride /
+                       bpp[drawable->pixel_format];
+  }
+
   rv = WSEGL_SUCCESS;
 
 err:
   free(buffer);
 
-  if (drawable->drawable_type == WSEGL_DRAWABLE_PIXMAP)
-    drawable->is_pixmap = WSEGL_TRUE;
+  if ( rv != WSEGL_SUCCESS )
+  {
+    pthread_mutex_unlock(&drawable->lock);
+    return rv;
+  }
+
+  /*
+   * Pixmap buffers never change, window buffers stay valid until the server
+   * sends an InvalidateBuffers event (DRI2 1.3 and later).
+   */
+  if (drawable->drawable_type == WSEGL_DRAWABLE_PIXMAP ||
+      drawable->display->dri2_minor >= 3)
+  {
+    drawable->buffers_valid = WSEGL_TRUE;
+    drawable->buffers_serial = serial;
+  }
 
-  if ( rv == WSEGL_SUCCESS )
-    goto ok;
+ok:
+  WSEGLDRI2UpdateBufferAge(drawable);
+
+  WSEGLDRI2RenderSize(drawable, &renderParams->ui32Width,
+                      &renderParams->ui32Height);
+  renderParams->ePixelFormat = drawable->pixel_format;
+  renderParams->ui32Stride = drawable->stride;
+  renderParams->pvLinearAddress = drawable->pvr_meminfo->pBase;
+  renderParams->ui32HWAddress = drawable->pvr_meminfo->ui32DevAddr;
+  renderParams->hPrivateData = drawable->pvr_meminfo->hPrivateData;
+
+  sourceParams->ui32Width = drawable->width;
+  sourceParams->ui32Height = drawable->height;
+  sourceParams->ui32Stride = renderParams->ui32Stride;
+  sourceParams->ePixelFormat = renderParams->ePixelFormat;
+  sourceParams->pvLinearAddress = renderParams->pvLinearAddress;
+  sourceParams->ui32HWAddress = renderParams->ui32HWAddress;
+  sourceParams->hPrivateData = renderParams->hPrivateData;
+
+  pthread_mutex_unlock(&drawable->lock);
 
-  return rv;
+  return WSEGL_SUCCESS;
+}
+
+/*
+ * Time every call of the function table for WSEGL_GetStatistics, and record
+ * it with its arguments if asked to. The arguments are taken before the
+ * call, which may free what they point to, what it returns through pointers
+ * after it, along with the structures, which live as long as the display.
+ */
+#define STAT_ENTRY_POINT(name, function, params, args, record, outs, \
+                         structs) \
+static WSEGLError \
+WSEGLDRI2Stat##name params \
+{ \
+  uint64_t record_args[] = { RECORD_ARGS record }; \
+  unsigned long long start = WSEGLDRI2StatTime(); \
+  WSEGLError rv = WSEGLDRI2##name args; \
+  \
+  WSEGLDRI2StatCall(function, start); \
+  \
+  if (record_file) \
+  { \
+    uint64_t record_outs[] = { 0, RECORD_ARGS outs }; \
+    void *record_structs = NULL; \
+    unsigned int record_structs_size = RECORD_ARGS structs; \
+    \
+    WSEGLDRI2RecordFunction(function, start, rv, record_args, \
+                            ARRAY_SIZE(record_args), record_outs + 1, \
+                            ARRAY_SIZE(record_outs) - 1, record_structs, \
+                            record_structs_size); \
+    free(record_structs); \
+  } \
+  \
+  return rv; \
 }
 
+STAT_ENTRY_POINT(IsDisplayValid, WSEGLDRI2_STAT_IS_DISPLAY_VALID,
+                 (NativeDisplayType dpy), (dpy),
+                 (RECORD_ARG(dpy)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(InitialiseDisplay, WSEGLDRI2_STAT_INITIALISE_DISPLAY,
+                 (NativeDisplayType dpy, WSEGLDisplayHandle *handle,
+                  const WSEGLCaps **caps, WSEGLConfig **configs),
+                 (dpy, handle, caps, configs),
+                 (RECORD_ARG(dpy)),
+                 (RECORD_OUT(rv, handle), RECORD_OUT(rv, caps),
+                  RECORD_OUT(rv, configs)),
+                 (WSEGLDRI2RecordCapsAndConfigs(rv, caps, configs,
+                                                &record_structs)))
+STAT_ENTRY_POINT(CloseDisplay, WSEGLDRI2_STAT_CLOSE_DISPLAY,
+                 (WSEGLDisplayHandle handle), (handle),
+                 (RECORD_ARG(handle)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(CreateWindowDrawable, WSEGLDRI2_STAT_CREATE_WINDOW_DRAWABLE,
+                 (WSEGLDisplayHandle handle, WSEGLConfig *config,
+                  WSEGLDrawableHandle *drawable, NativeWindowType window,
+                  WSEGLRotationAngle *rotationAngle),
+                 (handle, config, drawable, window, rotationAngle),
+                 (RECORD_ARG(handle), RECORD_ARG(config), RECORD_ARG(window)),
+                 (RECORD_OUT(rv, drawable), RECORD_OUT(rv, rotationAngle)),
+                 (WSEGLDRI2RecordConfigArg(config, &record_structs)))
+STAT_ENTRY_POINT(CreatePixmapDrawable, WSEGLDRI2_STAT_CREATE_PIXMAP_DRAWABLE,
+                 (WSEGLDisplayHandle handle, WSEGLConfig *config,
+                  WSEGLDrawableHandle *drawable, NativePixmapType pixmap,
+                  WSEGLRotationAngle *rotationAngle),
+                 (handle, config, drawable, pixmap, rotationAngle),
+                 (RECORD_ARG(handle), RECORD_ARG(config), RECORD_ARG(pixmap)),
+                 (RECORD_OUT(rv, drawable), RECORD_OUT(rv, rotationAngle)),
+                 (WSEGLDRI2RecordConfigArg(config, &record_structs)))
+STAT_ENTRY_POINT(DeleteDrawable, WSEGLDRI2_STAT_DELETE_DRAWABLE,
+                 (WSEGLDrawableHandle handle), (handle),
+                 (RECORD_ARG(handle)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(SwapDrawable, WSEGLDRI2_STAT_SWAP_DRAWABLE,
+                 (WSEGLDrawableHandle handle, unsigned long data),
+                 (handle, data),
+                 (RECORD_ARG(handle), RECORD_ARG(data)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(SwapControlInterval, WSEGLDRI2_STAT_SWAP_CONTROL_INTERVAL,
+                 (WSEGLDrawableHandle handle, unsigned long interval),
+                 (handle, interval),
+                 (RECORD_ARG(handle), RECORD_ARG(interval)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(WaitNative, WSEGLDRI2_STAT_WAIT_NATIVE,
+                 (WSEGLDrawableHandle handle, unsigned long engine),
+                 (handle, engine),
+                 (RECORD_ARG(handle), RECORD_ARG(engine)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(CopyFromDrawable, WSEGLDRI2_STAT_COPY_FROM_DRAWABLE,
+                 (WSEGLDrawableHandle handle, NativePixmapType pixmap),
+                 (handle, pixmap),
+                 (RECORD_ARG(handle), RECORD_ARG(pixmap)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(CopyFromPBuffer, WSEGLDRI2_STAT_COPY_FROM_PBUFFER,
+                 (void *address, unsigned long width, unsigned long height,
+                  unsigned long stride, WSEGLPixelFormat format,
+                  NativePixmapType pixmap),
+                 (address, width, height, stride, format, pixmap),
+                 (RECORD_ARG(address), RECORD_ARG(width), RECORD_ARG(height),
+                  RECORD_ARG(stride), RECORD_ARG(format), RECORD_ARG(pixmap)),
+                 (),
+                 (0))
+STAT_ENTRY_POINT(GetDrawableParameters, WSEGLDRI2_STAT_GET_DRAWABLE_PARAMETERS,
+                 (WSEGLDrawableHandle handle, WSEGLDrawableParams *sourceParams,
+                  WSEGLDrawableParams *renderParams),
+                 (handle, sourceParams, renderParams),
+                 (RECORD_ARG(handle), RECORD_ARG(sourceParams),
+                  RECORD_ARG(renderParams)),
+                 (),
+                 (WSEGLDRI2RecordDrawableParams(rv, sourceParams,
+                                                renderParams,
+                                                &record_structs)))
+
 static WSEGL_FunctionTable const wseglFunctions = {
   WSEGL_VERSION,
-  WSEGLDRI2IsDisplayValid,
-  WSEGLDRI2InitialiseDisplay,
-  WSEGLDRI2CloseDisplay,
-  WSEGLDRI2CreateWindowDrawable,
-  WSEGLDRI2CreatePixmapDrawable,
-  WSEGLDRI2DeleteDrawable,
-  WSEGLDRI2SwapDrawable,
-  WSEGLDRI2SwapControlInterval,
-  WSEGLDRI2WaitNative,
-  WSEGLDRI2CopyFromDrawable,
-  WSEGLDRI2CopyFromPBuffer,
-  WSEGLDRI2GetDrawableParameters
+  WSEGLDRI2StatIsDisplayValid,
+  WSEGLDRI2StatInitialiseDisplay,
+  WSEGLDRI2StatCloseDisplay,
+  WSEGLDRI2StatCreateWindowDrawable,
+  WSEGLDRI2StatCreatePixmapDrawable,
+  WSEGLDRI2StatDeleteDrawable,
+  WSEGLDRI2StatSwapDrawable,
+  WSEGLDRI2StatSwapControlInterval,
+  WSEGLDRI2StatWaitNative,
+  WSEGLDRI2StatCopyFromDrawable,
+  WSEGLDRI2StatCopyFromPBuffer,
+  WSEGLDRI2StatGetDrawableParameters
 };
 
+/*
+ * The callbacks from dri2.c run with the Xlib lock held, possibly while
+ * another thread holds the drawable lock and waits for a reply. They only
+ * take the list locks, which are never held across Xlib calls, and leave the
+ * rest to the render thread.
+ */
+
+/* Called by dri2.c when the server has invalidated the buffers of a drawable */
+void
+dri2InvalidateBuffers(Display *dpy, XID xid)
+{
+  wsegldri2_display *display;
+  wsegldri2_drawable *drawable;
+
+  pthread_mutex_lock(&display_lock);
+  display = WSEGLDRI2FindDisplay(dpy);
+
+  if (display)
+  {
+    pthread_mutex_lock(&display->drawables_lock);
+    drawable = WSEGLDRI2FindDrawable(display, xid);
+
+    /* Noticed by GetDrawableParameters */
+    if (drawable)
+      __sync_add_and_fetch(&drawable->invalidate_serial, 1);
+
+    pthread_mutex_unlock(&display->drawables_lock);
+  }
+
+  pthread_mutex_unlock(&display_lock);
+}
+
+/* Called by dri2.c when a swap queued with DRI2SwapBuffers has completed */
+void
+dri2SwapComplete(Display *dpy, XID xid, CARD64 sbc)
+{
+  wsegldri2_display *display;
+  wsegldri2_drawable *drawable;
+
+  pthread_mutex_lock(&display_lock);
+  display = WSEGLDRI2FindDisplay(dpy);
+
+  if (display)
+  {
+    pthread_mutex_lock(&display->drawables_lock);
+    drawable = WSEGLDRI2FindDrawable(display, xid);
+
+    /*
+     * Only the low 32 bits of the swap count are sent with the event, they
+     * are widened by WSEGLDRI2UpdateCompleteSbc.
+     */
+    if (drawable)
+      __sync_lock_test_and_set(&drawable->event_sbc, (unsigned int)sbc);
+
+    pthread_mutex_unlock(&display->drawables_lock);
+  }
+
+  pthread_mutex_unlock(&display_lock);
+}
+
+/*
+ * Find a drawable of the display dpy, returns with the display lock and the
+ * drawables lock held when it was found.
+ */
+static wsegldri2_drawable *
+WSEGLDRI2LockDrawable(Display *dpy, XID xid)
+{
+  wsegldri2_display *display;
+  wsegldri2_drawable *drawable;
+
+  pthread_mutex_lock(&display_lock);
+  display = WSEGLDRI2FindDisplay(dpy);
+
+  if (display)
+  {
+    pthread_mutex_lock(&display->drawables_lock);
+    drawable = WSEGLDRI2FindDrawable(display, xid);
+
+    if (drawable)
+      return drawable;
+
+    pthread_mutex_unlock(&display->drawables_lock);
+  }
+
+  pthread_mutex_unlock(&display_lock);
+
+  return NULL;
+}
+
+static void
+WSEGLDRI2UnlockDrawable(wsegldri2_drawable *drawable)
+{
+  pthread_mutex_unlock(&drawable->display->drawables_lock);
+  pthread_mutex_unlock(&display_lock);
+}
+
+int
+WSEGL_GetBufferAge(Display *dpy, Drawable xid)
+{
+  wsegldri2_drawable *drawable;
+  int age;
+  LOG();
+
+  drawable = WSEGLDRI2LockDrawable(dpy, xid);
+
+  if (!drawable)
+    return -1;
+
+  age = drawable->buffer_age;
+  WSEGLDRI2UnlockDrawable(drawable);
+
+  return age;
+}
+
+Bool
+WSEGL_SetBackBufferCount(Display *dpy, Drawable xid, int count)
+{
+  wsegldri2_drawable *drawable;
+  LOG();
+
+  if (count < 1 || count > 2)
+    return False;
+
+  drawable = WSEGLDRI2LockDrawable(dpy, xid);
+
+  if (!drawable)
+    return False;
+
+  /* Have the next GetDrawableParameters rebuild the flip chain if needed */
+  drawable->back_buffers_set = True;
+
+  if (drawable->back_buffers != count)
+  {
+    drawable->back_buffers = count;
+    __sync_add_and_fetch(&drawable->invalidate_serial, 1);
+  }
+
+  WSEGLDRI2UnlockDrawable(drawable);
+
+  return True;
+}
+
+/* Limit the next swap of a drawable to a list of damaged rectangles */
+Bool
+WSEGL_SetSwapDamage(Display *dpy, Drawable xid, const int *rects,
+                    int num_rects)
+{
+  wsegldri2_drawable *drawable;
+  XRectangle *damage = NULL;
+  XRectangle *old_damage;
+  int num_damage = 0;
+  int width;
+  int height;
+  int i;
+  LOG();
+
+  if (num_rects < 0)
+    return False;
+
+  drawable = WSEGLDRI2LockDrawable(dpy, xid);
+
+  if (!drawable)
+    return False;
+
+  width = drawable->width;
+  height = drawable->height;
+  WSEGLDRI2UnlockDrawable(drawable);
+
+  if (num_rects)
+  {
+    damage = (XRectangle *)malloc(num_rects * sizeof(XRectangle));
+    STAT_ADD(allocations, 1);
+
+    if (!damage)
+      return False;
+  }
+
+  for (i = 0; i < num_rects; i++)
+  {
+    const int *rect = &rects[4 * i];
+    int x1 = rect[0];
+    int y1 = height - rect[1] - rect[3];
+    int x2 = rect[0] + rect[2];
+    int y2 = height - rect[1];
+
+    if (x1 < 0)
+      x1 = 0;
+
+    if (y1 < 0)
+      y1 = 0;
+
+    if (x2 > width)
+      x2 = width;
+
+    if (y2 > height)
+      y2 = height;
+
+    if (x2 <= x1 || y2 <= y1)
+      continue;
+
+    damage[num_damage].x = x1;
+    damage[num_damage].y = y1;
+    damage[num_damage].width = x2 - x1;
+    damage[num_damage].height = y2 - y1;
+    num_damage++;
+  }
+
+  /* Everything got clipped away, nothing to present */
+  if (num_rects && !num_damage)
+  {
+    damage[0].x = 0;
+    damage[0].y = 0;
+    damage[0].width = 0;
+    damage[0].height = 0;
+    num_damage = 1;
+  }
+
+  /* The drawable may have gone away in the meantime */
+  drawable = WSEGLDRI2LockDrawable(dpy, xid);
+
+  if (!drawable)
+  {
+    free(damage);
+    return False;
+  }
+
+  old_damage = drawable->damage;
+  drawable->damage = damage;
+  drawable->num_damage = num_damage;
+  WSEGLDRI2UnlockDrawable(drawable);
+
+  free(old_damage);
+
+  return True;
+}
+
 /* Return the table of WSEGL functions to the EGL implementation */
 const WSEGL_FunctionTable *
 WSEGL_GetFunctionTablePointer(void)
@@ -0,0 +1,243 @@
+#ifndef _WSEGLDRI2_H_
+#define _WSEGLDRI2_H_
+
+#include <X11/Xlib.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Restrict the next eglSwapBuffers() on drawable to num_rects rectangles,
+ * passed as {x, y, width, height} quadruples with a bottom-left origin as in
+ * EGL_KHR_swap_buffers_with_damage and EGL_NV_post_sub_buffer. The damage is
+ * consumed by the swap; passing no rectangles restores a full window swap.
+ */
+Bool WSEGL_SetSwapDamage(Display *dpy, Drawable drawable, const int *rects,
+                         int num_rects);
+
+/*
+ * Number of frames since the current back buffer of drawable was last
+ * presented, as in EGL_EXT_buffer_age: 0 when its contents are undefined,
+ * 1 when it holds the frame just swapped. Valid once the driver has fetched
+ * the buffer for the frame being drawn. -1 if drawable is not a surface.
+ */
+int WSEGL_GetBufferAge(Display *dpy, Drawable drawable);
+
+/*
+ * Render drawable double (count 1) or triple (count 2) buffered, overriding
+ * the WSEGL_BackBuffers app hint. Takes effect from the next frame. Also
+ * caps the swaps in flight at count, below WSEGL_FramesInFlight if need be.
+ */
+Bool WSEGL_SetBackBufferCount(Display *dpy, Drawable drawable, int count);
+
+/* Entry points of the WSEGL function table, in table order */
+enum
+{
+  WSEGLDRI2_STAT_IS_DISPLAY_VALID,
+  WSEGLDRI2_STAT_INITIALISE_DISPLAY,
+  WSEGLDRI2_STAT_CLOSE_DISPLAY,
+  WSEGLDRI2_STAT_CREATE_WINDOW_DRAWABLE,
+  WSEGLDRI2_STAT_CREATE_PIXMAP_DRAWABLE,
+  WSEGLDRI2_STAT_DELETE_DRAWABLE,
+  WSEGLDRI2_STAT_SWAP_DRAWABLE,
+  WSEGLDRI2_STAT_SWAP_CONTROL_INTERVAL,
+  WSEGLDRI2_STAT_WAIT_NATIVE,
+  WSEGLDRI2_STAT_COPY_FROM_DRAWABLE,
+  WSEGLDRI2_STAT_COPY_FROM_PBUFFER,
+  WSEGLDRI2_STAT_GET_DRAWABLE_PARAMETERS,
+  WSEGLDRI2_STAT_NUM_FUNCTIONS
+};
+
+typedef struct
+{
+  unsigned long long calls;
+  /* In nanoseconds, the percentiles are rounded up to a power of 2 */
+  unsigned long long p50_ns;
+  unsigned long long p99_ns;
+  unsigned long long max_ns;
+} WSEGLDRI2FunctionStatistics;
+
+typedef struct
+{
+  WSEGLDRI2FunctionStatistics functions[WSEGLDRI2_STAT_NUM_FUNCTIONS];
+  /* Requests that waited for a reply from the X server */
+  unsigned long long round_trips;
+  /* Server buffers wrapped for the GPU with PVR2DMemWrap */
+  unsigned long long mem_wraps;
+  /* Segments attached to the X server with XShmAttach */
+  unsigned long long shm_attaches;
+  /* Image data put to pixmaps by the copy functions */
+  unsigned long long bytes_copied;
+  /*
+   * Heap and shm allocations, including DRI2GetBuffers replies. Divided by
+   * the SwapDrawable calls, this and round_trips give the per-frame cost.
+   */
+  unsigned long long allocations;
+} WSEGLDRI2Statistics;
+
+/*
+ * Statistics of all displays since the library was loaded or since the last
+ * WSEGL_ResetStatistics(). Setting the WSEGL_StatisticsFile app hint also
+ * appends them to that file every WSEGL_StatisticsPeriod seconds.
+ */
+void WSEGL_GetStatistics(WSEGLDRI2Statistics *stats);
+void WSEGL_ResetStatistics(void);
+
+/*
+ * With the WSEGL_TraceEvents app hint set to a number of events, swaps,
+ * buffer lookups and drawable lifetimes are recorded into a ring buffer of
+ * that size. Write it out as Chrome trace-event JSON to path, or to the file
+ * named by the WSEGL_TraceFile app hint when path is NULL. The trace is also
+ * written there when the library is unloaded.
+ */
+Bool WSEGL_WriteTrace(const char *path);
+
+/*
+ * Setting the WSEGL_RecordFile app hint records every call into the WSEGL
+ * function table to that file, along with what the X server and PVR2D
+ * returned to the plugin, so a session can be fed back through it later.
+ *
+ * The file starts with WSEGLDRI2_RECORD_MAGIC and WSEGLDRI2_RECORD_VERSION
+ * as two 32-bit words, followed by records. Each record is a
+ * WSEGLDRI2RecordHeader and size bytes of payload, depending on type. All
+ * fields are in the byte order of the recording device.
+ */
+#define WSEGLDRI2_RECORD_MAGIC 0x52474557 /* "WEGR" */
+#define WSEGLDRI2_RECORD_VERSION 3
+
+enum
+{
+  /* A WSEGLDRI2RecordCall */
+  WSEGLDRI2_RECORD_CALL = 1,
+  /* A WSEGLDRI2RecordBuffers */
+  WSEGLDRI2_RECORD_BUFFERS,
+  /* A WSEGLDRI2RecordPVR2D */
+  WSEGLDRI2_RECORD_PVR2D
+};
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t size;
+  /* CLOCK_MONOTONIC, at the start of the call for WSEGLDRI2_RECORD_CALL */
+  uint64_t time_ns;
+  uint32_t tid;
+  uint32_t reserved;
+} WSEGLDRI2RecordHeader;
+
+/*
+ * A call into the function table, one of WSEGLDRI2_STAT_*. Followed by the
+ * num_args input arguments in order, each as an uint64_t, then by the
+ * num_outs values the call returned through its pointer arguments, in order,
+ * 0 if the call failed. Handles and pointers only identify objects across
+ * records, what they point to follows for the calls that take or return
+ * structures:
+ *
+ *   INITIALISE_DISPLAY       the caps up to the WSEGL_NO_CAPS entry as
+ *                            WSEGLDRI2RecordCaps, then the configs up to the
+ *                            one with no drawable type as
+ *                            WSEGLDRI2RecordConfig, both terminators included,
+ *                            if the call succeeded
+ *   CREATE_WINDOW_DRAWABLE,  the config passed in, as a WSEGLDRI2RecordConfig
+ *   CREATE_PIXMAP_DRAWABLE
+ *   GET_DRAWABLE_PARAMETERS  the source and render parameters returned, as
+ *                            two WSEGLDRI2RecordParams, if the call succeeded
+ *
+ * The pixels passed to CopyFromPBuffer are not recorded.
+ */
+typedef struct
+{
+  uint32_t function;
+  uint32_t result;
+  uint64_t duration_ns;
+  uint32_t num_args;
+  uint32_t num_outs;
+} WSEGLDRI2RecordCall;
+
+/* A WSEGLCaps */
+typedef struct
+{
+  uint32_t type;
+  uint32_t value;
+} WSEGLDRI2RecordCaps;
+
+/* A WSEGLConfig */
+typedef struct
+{
+  uint32_t drawable_type;
+  uint32_t pixel_format;
+  uint32_t native_renderable;
+  uint32_t frame_buffer_level;
+  uint64_t native_visual_id;
+  uint64_t native_visual;
+  uint32_t transparent_type;
+  uint32_t transparent_color;
+} WSEGLDRI2RecordConfig;
+
+/* A WSEGLDrawableParams */
+typedef struct
+{
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t pixel_format;
+  uint64_t linear_address;
+  uint64_t private_data;
+  uint32_t hw_address;
+  uint32_t reserved;
+} WSEGLDRI2RecordParams;
+
+/*
+ * A DRI2GetBuffers reply. Followed by up to as many buffers as were asked
+ * for, each as the attachment, name, pitch, cpp and flags uint32_t words.
+ */
+typedef struct
+{
+  uint64_t drawable;
+  int32_t width;
+  int32_t height;
+  int32_t count;
+  uint32_t reserved;
+} WSEGLDRI2RecordBuffers;
+
+/*
+ * PVR2D calls. name and size are the DRI2 buffer name and size for MEM_WRAP
+ * and GET_FRAME_BUFFER, the shm id and size of a staging buffer for
+ * STAGING_WRAP, the buffers asked for or got and the size of each for the
+ * flip chain calls, the index of the buffer for PRESENT_FLIP, the
+ * destination drawable and bytes written for BLT, the drawable and size
+ * of the buffer a rotated drawable renders into for MEM_ALLOC and the
+ * interval passed down for SET_FLIP_INTERVAL.
+ */
+enum
+{
+  WSEGLDRI2_RECORD_MEM_WRAP = 1,
+  WSEGLDRI2_RECORD_GET_FRAME_BUFFER,
+  WSEGLDRI2_RECORD_CREATE_FLIP_CHAIN,
+  WSEGLDRI2_RECORD_GET_FLIP_CHAIN_BUFFERS,
+  WSEGLDRI2_RECORD_PRESENT_FLIP,
+  WSEGLDRI2_RECORD_DESTROY_FLIP_CHAIN,
+  WSEGLDRI2_RECORD_BLT,
+  WSEGLDRI2_RECORD_STAGING_WRAP,
+  WSEGLDRI2_RECORD_MEM_ALLOC,
+  WSEGLDRI2_RECORD_SET_FLIP_INTERVAL
+};
+
+/* A PVR2D call, with its result and the device address of its buffer */
+typedef struct
+{
+  uint32_t op;
+  int32_t result;
+  uint32_t name;
+  uint32_t size;
+  uint32_t dev_addr;
+  uint32_t reserved;
+} WSEGLDRI2RecordPVR2D;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif